@@ -9,15 +9,18 @@ Then drives a connected 3D printer board to move the z-axis.
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <math.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "getopt_portable.h"
 
 #define MIN_VAL 0
@@ -29,8 +32,20 @@ Then drives a connected 3D printer board to move the z-axis.
 #define BAUDRATE B115200
 #define FILENAME "gcode.gcode"  // default gcode file to parse
 
-#define Z_DELAY 10              // amount of time to delay during any Z-moves
-#define HOME_DELAY 5            // amount of time to delay while homing Z
+#define Z_SETTLE 1000           // default ms to wait once a Z-move has completed
+
+#define SERIAL_QUEUE 64         // lines that can be waiting to go out to the printer board
+#define SERIAL_TIMEOUT 30000    // ms to wait for the printer board before complaining
+#define BOOT_TIMEOUT 10000      // ms to wait for the printer board to come up after opening the port
+
+#define READ_CHUNK 65536         // how much of the g-code file to read at a time
+
+#define PIPELINE_DEPTH 2         // number of jobs the parser may get ahead of the output in pipelined mode
+
+#define GRID_MAX 256             // most cells along each side of the grid the path optimizer files path ends in
+#define OPT_PASSES 8             // most 2-opt passes the path optimizer makes over a layer
+
+#define JUMP_DWELL 10            // default samples to hold still after a jump before the laser turns on
 
 #define LAYER_STICK 3           // number of layers to overexpose for stickiness
 #define OVER_EXPOSE 3 // 4          // amount to slow the laser while overexposing early layers
@@ -50,7 +65,123 @@ float dimension = 110.485;          // size of full-scale x and y dimensions on
 int abs_pos = 1;                // absolute positioning by default
 int fd;                         // the serial buffer to be output
 int lineNum = 0;                // the rolling line number for the serial output
+int zSettle = Z_SETTLE;         // ms to wait once a Z-move has completed
 int superStick = 0;             // tracking whether we are overexposing right now or not
+int jumpStep = 0;               // most DAC steps per sample on either axis for blanked moves, or 0 to step them
+int jumpDwell = JUMP_DWELL;     // samples to let the galvos settle after a jump
+int settleDue = 0;              // dwell samples still owed from the last jump
+int posX = 0;                   // where the g-code has moved to. The laser lags behind while paths are collected
+int posY = 0;
+
+// pipelined mode: samples are formatted into memory instead of going straight to stdout. At each serial
+// command the samples so far and the command are queued as a job for the output thread, which writes the
+// samples out and then runs the command, while the parser goes on with the next layer.
+int pipelined = 0;
+
+struct sampleBuffer {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+struct outputJob {
+    struct sampleBuffer samples;   // written out first
+    char *lineOut;                 // then sent to the printer board, if not NULL
+    int waitTime;
+    struct outputJob *next;
+};
+
+// the serial controller. Lines are numbered and checksummed, and go out one at a time from a queue. Each
+// stays at the head of the queue until the printer board acknowledges it with "ok", or is sent again if
+// the board asks for it with "Resend". serialPoll() does all the reading and writing, without blocking.
+struct serialLine {
+    int num;
+    char *text;                 // "N<num> <command>*<checksum>\n"
+    int len;
+};
+
+struct serialLine serialQueue[SERIAL_QUEUE];
+int serialHead = 0;             // oldest line not yet acknowledged
+int serialCount = 0;
+int serialWritten = 0;          // bytes of the head line written so far
+int serialSkipOk = 0;           // oks still to come for lines the board asked to have resent
+int serialReady = 0;            // the board has said something since the port was opened
+char serialReply[256];          // the reply being read in
+int serialReplyLen = 0;
+
+struct sampleBuffer layerSamples;  // samples since the last serial command
+
+// path optimization: the laser-on moves of each layer are collected as paths instead of being drawn straight
+// away. When the layer ends they are drawn in whichever order, and whichever way round, needs the least blanked
+// travel between them.
+int optimize = 0;
+
+struct pathPoint {
+    int x;
+    int y;
+};
+
+struct path {                   // a run of laser-on moves, from pathPoints[first] to pathPoints[last]
+    int first;
+    int last;
+    int reversed;               // drawn from last to first
+};
+
+struct gridEnd {                // one end of a path, filed in the grid
+    int path;
+    int end;                    // 0 for its first point, 1 for its last
+};
+
+struct pathGrid {
+    int size;                   // cells along each side
+    int cellSize;               // DAC steps along each side of a cell
+    int *cellStart;             // where each cell's ends start in ends[]
+    struct gridEnd *ends;
+};
+
+struct pathPoint *pathPoints = NULL;
+int pointCount = 0;
+int pointSize = 0;
+struct path *paths = NULL;
+int pathCount = 0;
+int pathSize = 0;
+int pathOpen = 0;               // the last move had the laser on, so the next one carries on the same path
+long long layerTravel = 0;      // blanked travel in this layer if it were drawn in file order, in DAC steps
+struct pathPoint travelFrom;    // where the laser would be now if it were drawn in file order
+int travelStarted = 0;          // travelFrom has been set for this layer
+long long travelBefore = 0;     // the same over the whole print
+long long travelAfter = 0;      // and as drawn
+struct outputJob *jobHead = NULL;
+struct outputJob *jobTail = NULL;
+int jobCount = 0;
+int jobsDone = 0;                  // no more jobs will be queued
+pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t jobCond = PTHREAD_COND_INITIALIZER;
+pthread_t outputThread;
+
+// the g-code file, read in large chunks and tokenized straight out of the buffer
+struct gcodeReader {
+    FILE *file;
+    char *buf;
+    size_t size;                // room in buf, not counting the sentinel
+    size_t pos;                 // start of the next line
+    size_t len;                 // bytes read into buf, followed by a '\n' sentinel
+    int eof;
+};
+
+// one letter and number pair of a g-code line, e.g. X12.5
+struct gcodeWord {
+    char letter;                // upper case
+    float value;
+};
+
+// the words of the current line. The words array grows as needed and is reused from line to line.
+struct gcodeLine {
+    char *text;                 // the whole line without its newline, for sending on to the printer board
+    struct gcodeWord *words;
+    int count;
+    int size;
+};
 
 void print_help(const char* prog_name, FILE* stream)
 {
@@ -82,6 +213,20 @@ void print_help(const char* prog_name, FILE* stream)
 
     fprintf(stream, "Sweep speed:\n (default is 20000)\n");
     fprintf(stream, "\t-r\tRate to display samples at. Must be between 1 and 30,000\n");
+
+    fprintf(stream, "Z-axis:\n");
+    fprintf(stream, "\t-p\tSerial port of the printer board (default is %s).\n", PORTNAME);
+    fprintf(stream, "\t-s\tTime in ms to wait once a Z-move has completed (default is %d).\n", Z_SETTLE);
+
+    fprintf(stream, "Pipelining:\n (default is off)\n");
+    fprintf(stream, "\t-P\tPrepare the next layer in memory while the Z-axis moves.\n");
+
+    fprintf(stream, "Blanked moves:\n (default is to step them like drawn moves)\n");
+    fprintf(stream, "\t-J\tJump blanked moves, at most this many DAC steps per sample on either axis.\n");
+    fprintf(stream, "\t-W\tSamples to dwell after a jump before the laser turns on (default is %d).\n", JUMP_DWELL);
+
+    fprintf(stream, "Path optimization:\n (default is off)\n");
+    fprintf(stream, "\t-O\tReorder each layer's paths to cut down blanked travel between them.\n");
 }
 
 // used for serial connection to motor drivers
@@ -143,6 +288,29 @@ int roundNum(double num)
     return num < 0 ? num - 0.5 : num + 0.5;
 }
 
+// print out one sample, or add it to the current layer in pipelined mode
+void putSample(int x, int y, int a, int b, int c, int intl_a)
+{
+    int len;
+
+    if (!pipelined) {
+        printf("s=%u,%u,%u,%u,%u,%u\n", x, y, a, b, c, intl_a); // x, y, a, b, c, intl_a
+        return;
+    }
+
+    if (layerSamples.size - layerSamples.len < 64) {
+        layerSamples.size = layerSamples.size ? layerSamples.size * 2 : 1 << 20;
+        layerSamples.data = realloc(layerSamples.data, layerSamples.size);
+        if (layerSamples.data == NULL) {
+            fprintf(stderr, "Error: out of memory for layer samples.\n");
+            exit(1);
+        }
+    }
+    len = snprintf(layerSamples.data + layerSamples.len, layerSamples.size - layerSamples.len,
+                   "s=%u,%u,%u,%u,%u,%u\n", x, y, a, b, c, intl_a); // x, y, a, b, c, intl_a
+    layerSamples.len += len;
+}
+
 // apply scalar factors to values and print them out
 // MSS -- e-factor and m-factor processing doesn't seem to work yet
 void sendScaled(int x, int y, int a, int b, int c, int intl_a)
@@ -172,10 +340,8 @@ void sendScaled(int x, int y, int a, int b, int c, int intl_a)
     if ((new_x >= 0) && (new_x <= RES_MAX) && (new_y >= 0) && (new_y <= RES_MAX)) {
         if (superStick) // early layers want more exposure to stick better
             for (i=1; i < OVER_EXPOSE; i++) // make the laser stay at its current spot longer to overexpose the layer
-                printf("s=%u,%u,%u,%u,%u,%u\n",
-                    new_x, new_y, a, b, c, intl_a); // x, y, a, b, c, intl_a
-        printf("s=%u,%u,%u,%u,%u,%u\n",
-            new_x, new_y, a, b, c, intl_a); // x, y, a, b, c, intl_a
+                putSample(new_x, new_y, a, b, c, intl_a);
+        putSample(new_x, new_y, a, b, c, intl_a);
     }
 
     return;
@@ -189,6 +355,27 @@ int pixelize(float rawval)
     return roundNum(output);
 }
 
+// jump to a spot with the laser off, in as few samples as the galvos can follow: evenly spaced along the line
+// and no more than jumpStep apart on either axis
+void jumpLaser(int newX, int newY)
+{
+    int startX = nowX;
+    int startY = nowY;
+    int deltaX = newX - nowX;
+    int deltaY = newY - nowY;
+    int steps = (abs(deltaX) > abs(deltaY) ? abs(deltaX) : abs(deltaY));
+    int i;
+
+    steps = (steps + jumpStep - 1) / jumpStep;
+    for (i = 1; i <= steps; i++) {
+        nowX = startX + roundNum((double)deltaX * i / steps);
+        nowY = startY + roundNum((double)deltaY * i / steps);
+        sendScaled(nowX, nowY, a_min, b_min, 0, 1); // x, y, a, b, c, intl_a
+    }
+    if (steps > 0)
+        settleDue = jumpDwell; // the galvos overshoot, so hold here before drawing
+}
+
 // the g-code parser
 void moveLaser(int newX, int newY, int laserOn)
 {
@@ -206,6 +393,15 @@ void moveLaser(int newX, int newY, int laserOn)
     int i;
     int over = 0;
 
+    if (!laserOn && jumpStep > 0) {
+        jumpLaser(newX, newY);
+        return;
+    }
+    if (laserOn && (deltaX || deltaY)) {
+        for (; settleDue > 0; settleDue--)
+            sendScaled(nowX, nowY, a_min, b_min, 0, 1); // x, y, a, b, c, intl_a
+    }
+
     if(deltaX > deltaY) {
         for(i=0;i < deltaX;++i) {
             nowX += dirX;
@@ -245,46 +441,705 @@ void moveLaser(int newX, int newY, int laserOn)
     }
 }
 
+// the distance between two points, as the blanked move between them costs: stepping takes a sample for each step
+// on either axis, while the samples of a jump only depend on the longer axis
+int travelDist(struct pathPoint *from, struct pathPoint *to)
+{
+    int distX = abs(to->x - from->x);
+    int distY = abs(to->y - from->y);
+
+    if (jumpStep > 0)
+        return distX > distY ? distX : distY;
+    return distX + distY;
+}
+
+// the point a path is drawn from, or to, the way round it is drawn now
+struct pathPoint *pathStart(struct path *p)
+{
+    return &pathPoints[p->reversed ? p->last : p->first];
+}
+
+struct pathPoint *pathEnd(struct path *p)
+{
+    return &pathPoints[p->reversed ? p->first : p->last];
+}
+
+// collect one move for the path optimizer instead of drawing it
+void addMove(int newX, int newY, int laserOn)
+{
+    struct pathPoint here, there;
+
+    if (!travelStarted) { // both ways of drawing the layer start from where the laser is
+        travelFrom.x = nowX;
+        travelFrom.y = nowY;
+        travelStarted = 1;
+    }
+    there.x = newX;
+    there.y = newY;
+
+    if (!laserOn) {
+        layerTravel += travelDist(&travelFrom, &there);
+        travelFrom = there;
+        pathOpen = 0;
+        return;
+    }
+    if (!pathOpen && newX == posX && newY == posY) // nothing to draw
+        return;
+
+    if (pointCount + 2 > pointSize || pathCount + 1 > pathSize) {
+        pointSize = pointSize ? pointSize * 2 : 4096;
+        pathSize = pathSize ? pathSize * 2 : 1024;
+        pathPoints = realloc(pathPoints, pointSize * sizeof(*pathPoints));
+        paths = realloc(paths, pathSize * sizeof(*paths));
+        if (pathPoints == NULL || paths == NULL) {
+            fprintf(stderr, "Error: out of memory for layer paths.\n");
+            exit(1);
+        }
+    }
+
+    if (!pathOpen) { // start a new path where the laser turns on
+        paths[pathCount].first = pointCount;
+        paths[pathCount].reversed = 0;
+        pathPoints[pointCount].x = posX;
+        pathPoints[pointCount].y = posY;
+        pointCount++;
+        pathCount++;
+        pathOpen = 1;
+
+        here.x = posX;
+        here.y = posY;
+        layerTravel += travelDist(&travelFrom, &here); // only when the layer starts off from somewhere else
+    }
+    pathPoints[pointCount].x = newX;
+    pathPoints[pointCount].y = newY;
+    paths[pathCount - 1].last = pointCount;
+    pointCount++;
+    travelFrom = there;
+}
+
+// the cell of the path grid a point falls in
+int gridCell(struct pathGrid *grid, struct pathPoint *pt, int *cellX, int *cellY)
+{
+    *cellX = pt->x / grid->cellSize;
+    *cellY = pt->y / grid->cellSize;
+    if (*cellX < 0) *cellX = 0;
+    if (*cellX >= grid->size) *cellX = grid->size - 1;
+    if (*cellY < 0) *cellY = 0;
+    if (*cellY >= grid->size) *cellY = grid->size - 1;
+    return *cellY * grid->size + *cellX;
+}
+
+// bucket both ends of every path by grid cell, so the ends near a point can be found without looking at all of them
+void buildGrid(struct pathGrid *grid)
+{
+    int cells;
+    int cellX, cellY;
+    int cell;
+    int i, end;
+
+    grid->size = sqrt(pathCount / 2);
+    if (grid->size < 1) grid->size = 1;
+    if (grid->size > GRID_MAX) grid->size = GRID_MAX;
+    grid->cellSize = (RES_MAX + grid->size) / grid->size;
+
+    cells = grid->size * grid->size;
+    grid->cellStart = calloc(cells + 1, sizeof(int));
+    grid->ends = malloc(2 * pathCount * sizeof(*grid->ends));
+    if (grid->cellStart == NULL || grid->ends == NULL) {
+        fprintf(stderr, "Error: out of memory for layer paths.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < pathCount; i++) // count the ends in each cell...
+        for (end = 0; end < 2; end++)
+            grid->cellStart[gridCell(grid, &pathPoints[end ? paths[i].last : paths[i].first], &cellX, &cellY) + 1]++;
+    for (cell = 0; cell < cells; cell++)
+        grid->cellStart[cell + 1] += grid->cellStart[cell];
+    for (i = 0; i < pathCount; i++) // ...then file them, which moves each cell's start on to the next cell's
+        for (end = 0; end < 2; end++) {
+            cell = gridCell(grid, &pathPoints[end ? paths[i].last : paths[i].first], &cellX, &cellY);
+            grid->ends[grid->cellStart[cell]].path = i;
+            grid->ends[grid->cellStart[cell]].end = end;
+            grid->cellStart[cell]++;
+        }
+    for (cell = cells; cell > 0; cell--)
+        grid->cellStart[cell] = grid->cellStart[cell - 1];
+    grid->cellStart[0] = 0;
+}
+
+// look through the ends in one grid cell for the nearest one of a path not drawn yet
+void nearestInCell(struct pathGrid *grid, int cellX, int cellY, struct pathPoint *from, char *drawn,
+                   int *best, int *bestEnd, int *bestDist)
+{
+    int cell = cellY * grid->size + cellX;
+    int i, dist;
+    struct gridEnd *e;
+
+    for (i = grid->cellStart[cell]; i < grid->cellStart[cell + 1]; i++) {
+        e = &grid->ends[i];
+        if (drawn[e->path])
+            continue;
+        dist = travelDist(from, &pathPoints[e->end ? paths[e->path].last : paths[e->path].first]);
+        if (*best < 0 || dist < *bestDist) {
+            *best = e->path;
+            *bestEnd = e->end;
+            *bestDist = dist;
+        }
+    }
+}
+
+// put the paths in an order that keeps the blanked travel between them short: nearest neighbour first, starting
+// from where the laser is, then 2-opt to undo the worst of its crossings. The order goes into order[].
+void orderPaths(int *order)
+{
+    struct pathGrid grid;
+    struct pathPoint here;
+    struct pathPoint *from, *b, *c, *d;
+    struct gridEnd *e;
+    char *drawn = calloc(pathCount, 1);
+    int *place = malloc(pathCount * sizeof(int)); // where each path is in order[]
+    int best, bestEnd, bestDist;
+    int cellX, cellY, ring, x, y;
+    int i, j, k, n, tmp;
+    int delta;
+    int improved, passes;
+
+    if (drawn == NULL || place == NULL) {
+        fprintf(stderr, "Error: out of memory for layer paths.\n");
+        exit(1);
+    }
+    buildGrid(&grid);
+
+    here.x = nowX;
+    here.y = nowY;
+    for (n = 0; n < pathCount; n++) {
+        // search outwards ring by ring, until nothing further out can be nearer than the best so far
+        best = -1;
+        gridCell(&grid, &here, &cellX, &cellY);
+        for (ring = 0; ring < grid.size; ring++) {
+            for (x = cellX - ring; x <= cellX + ring; x++) {
+                if (x < 0 || x >= grid.size)
+                    continue;
+                if (cellY - ring >= 0)
+                    nearestInCell(&grid, x, cellY - ring, &here, drawn, &best, &bestEnd, &bestDist);
+                if (ring > 0 && cellY + ring < grid.size)
+                    nearestInCell(&grid, x, cellY + ring, &here, drawn, &best, &bestEnd, &bestDist);
+            }
+            for (y = cellY - ring + 1; y <= cellY + ring - 1; y++) {
+                if (y < 0 || y >= grid.size)
+                    continue;
+                if (cellX - ring >= 0)
+                    nearestInCell(&grid, cellX - ring, y, &here, drawn, &best, &bestEnd, &bestDist);
+                if (cellX + ring < grid.size)
+                    nearestInCell(&grid, cellX + ring, y, &here, drawn, &best, &bestEnd, &bestDist);
+            }
+            if (best >= 0 && bestDist <= ring * grid.cellSize)
+                break;
+        }
+
+        drawn[best] = 1;
+        paths[best].reversed = bestEnd; // nearest by its last point, so draw it backwards
+        order[n] = best;
+        place[best] = n;
+        here = *pathEnd(&paths[best]);
+    }
+
+    // 2-opt: drawing order[i..j] the other way round, each path reversed, swaps the travel into order[i] and out of
+    // order[j] for travel into order[j] and out of order[i]. Only the ends near the travel's start are tried.
+    here.x = nowX;
+    here.y = nowY;
+    improved = 1;
+    for (passes = 0; improved && passes < OPT_PASSES; passes++) {
+        improved = 0;
+        for (i = 0; i < pathCount; i++) {
+            from = i ? pathEnd(&paths[order[i - 1]]) : &here;
+            b = pathStart(&paths[order[i]]);
+            gridCell(&grid, from, &cellX, &cellY);
+            for (y = cellY - 1; y <= cellY + 1; y++) {
+                for (x = cellX - 1; x <= cellX + 1; x++) {
+                    if (x < 0 || x >= grid.size || y < 0 || y >= grid.size)
+                        continue;
+                    for (k = grid.cellStart[y * grid.size + x]; k < grid.cellStart[y * grid.size + x + 1]; k++) {
+                        e = &grid.ends[k];
+                        j = place[e->path];
+                        if (j < i || e->end == paths[e->path].reversed) // behind us, or not the end it's drawn to
+                            continue;
+                        c = pathEnd(&paths[order[j]]);
+                        d = j + 1 < pathCount ? pathStart(&paths[order[j + 1]]) : NULL;
+                        delta = travelDist(from, c) - travelDist(from, b);
+                        if (d)
+                            delta += travelDist(b, d) - travelDist(c, d);
+                        if (delta >= 0)
+                            continue;
+
+                        for (n = i; n <= j; n++)
+                            paths[order[n]].reversed = !paths[order[n]].reversed;
+                        for (n = 0; n < (j - i + 1) / 2; n++) {
+                            tmp = order[i + n];
+                            order[i + n] = order[j - n];
+                            order[j - n] = tmp;
+                        }
+                        for (n = i; n <= j; n++)
+                            place[order[n]] = n;
+                        b = pathStart(&paths[order[i]]);
+                        improved = 1;
+                    }
+                }
+            }
+        }
+    }
+
+    free(grid.cellStart);
+    free(grid.ends);
+    free(drawn);
+    free(place);
+}
+
+// draw the paths collected since the last flush, in the order that keeps the blanked travel between them short
+void flushPaths()
+{
+    struct pathPoint here;
+    struct path *p;
+    long long travel = 0;
+    int *order;
+    int i, k, step;
+
+    if (pathCount > 0) {
+        order = malloc(pathCount * sizeof(int));
+        if (order == NULL) {
+            fprintf(stderr, "Error: out of memory for layer paths.\n");
+            exit(1);
+        }
+        orderPaths(order);
+
+        for (i = 0; i < pathCount; i++) {
+            p = &paths[order[i]];
+            here.x = nowX;
+            here.y = nowY;
+            travel += travelDist(&here, pathStart(p));
+            moveLaser(pathStart(p)->x, pathStart(p)->y, 0);
+            step = p->reversed ? -1 : 1;
+            for (k = (p->reversed ? p->last : p->first) + step; k != (p->reversed ? p->first : p->last) + step; k += step)
+                moveLaser(pathPoints[k].x, pathPoints[k].y, 1);
+        }
+        free(order);
+
+        fprintf(stderr, "Layer paths: %d, blanked travel %lld -> %lld steps\n", pathCount, layerTravel, travel);
+    }
+
+    travelBefore += layerTravel;
+    travelAfter += travel;
+    layerTravel = 0;
+    travelStarted = 0;
+    pointCount = 0;
+    pathCount = 0;
+    pathOpen = 0;
+}
+
+long long nowMs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// act on one line from the printer board
+void serialHandleReply(char *reply)
+{
+    int num;
+
+    serialReady = 1;
+
+    if (strncmp(reply, "ok", 2) == 0) {
+        if (serialSkipOk > 0) // the ok that follows a resend request
+            serialSkipOk--;
+        else if (serialCount > 0 && serialWritten == serialQueue[serialHead].len) {
+            free(serialQueue[serialHead].text);
+            serialHead = (serialHead + 1) % SERIAL_QUEUE;
+            serialCount--;
+            serialWritten = 0;
+        }
+    }
+    else if (strncmp(reply, "Resend:", 7) == 0 || strncmp(reply, "rs ", 3) == 0) {
+        num = atoi(reply + (reply[0] == 'R' ? 7 : 3));
+        if (serialCount > 0 && serialQueue[serialHead].num == num)
+            serialWritten = 0; // send it again
+        else
+            fprintf(stderr, "Printer board asked to resend line %d, which isn't waiting\n", num);
+        serialSkipOk++;
+    }
+    else if (strncmp(reply, "Error", 5) == 0 || strncmp(reply, "!!", 2) == 0) {
+        fprintf(stderr, "Printer board: %s\n", reply);
+    }
+}
+
+// write out the head of the send queue and read whatever the printer board has to say, waiting up to
+// timeout ms for either to be possible. Returns 0 on timeout, 1 if anything happened.
+int serialPoll(int timeout)
+{
+    struct pollfd pfd;
+    struct serialLine *line = &serialQueue[serialHead];
+    char buf[256];
+    int len;
+    int i;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (serialCount > 0 && serialWritten < line->len)
+        pfd.events |= POLLOUT;
+
+    len = poll(&pfd, 1, timeout);
+    if (len < 0 && errno != EINTR) {
+        fprintf(stderr, "Error from poll: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (len <= 0)
+        return 0;
+
+    if (pfd.revents & POLLOUT) {
+        len = write(fd, line->text + serialWritten, line->len - serialWritten);
+        if (len < 0 && errno != EAGAIN && errno != EINTR) {
+            fprintf(stderr, "Error from write: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (len > 0)
+            serialWritten += len;
+    }
+
+    if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+        len = read(fd, buf, sizeof(buf));
+        if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+            fprintf(stderr, "Error from read: %s\n", len == 0 ? "port closed" : strerror(errno));
+            exit(1);
+        }
+        for (i = 0; i < len; i++) {
+            if (buf[i] == '\n') {
+                serialReply[serialReplyLen] = 0;
+                serialHandleReply(serialReply);
+                serialReplyLen = 0;
+            }
+            else if (buf[i] != '\r' && serialReplyLen < sizeof(serialReply) - 1)
+                serialReply[serialReplyLen++] = buf[i];
+        }
+    }
+
+    return 1;
+}
+
+// queue a command for the printer board, without its comment, and start sending it
+void serialSend(char *command)
+{
+    struct serialLine *line;
+    int len = strcspn(command, ";");
+    int checksum = 0;
+    int i;
+
+    while (len > 0 && isspace((unsigned char)command[len - 1]))
+        len--;
+    if (len == 0)
+        return;
+
+    while (serialCount == SERIAL_QUEUE)
+        if (!serialPoll(SERIAL_TIMEOUT))
+            fprintf(stderr, "Still waiting for the printer board to acknowledge line %d\n", serialQueue[serialHead].num);
+
+    line = &serialQueue[(serialHead + serialCount) % SERIAL_QUEUE];
+    line->text = malloc(len + 32);
+    if (line->text == NULL) {
+        fprintf(stderr, "Error: out of memory for serial line.\n");
+        exit(1);
+    }
+    line->num = lineNum++;
+    line->len = sprintf(line->text, "N%d %.*s", line->num, len, command);
+    for (i = 0; i < line->len; i++)
+        checksum ^= (unsigned char)line->text[i];
+    line->len += sprintf(line->text + line->len, "*%d\n", checksum);
+    serialCount++;
+
+    serialPoll(0);
+}
+
+// wait until the printer board has acknowledged every queued line
+void serialFlush()
+{
+    while (serialCount > 0)
+        if (!serialPoll(SERIAL_TIMEOUT))
+            fprintf(stderr, "Still waiting for the printer board to acknowledge line %d\n", serialQueue[serialHead].num);
+}
+
+// keep the serial port serviced for ms
+void serialWait(int ms)
+{
+    long long deadline = nowMs() + ms;
+    long long left;
+
+    while ((left = deadline - nowMs()) > 0)
+        serialPoll(left);
+}
+
+// send a line to the printer board. With waitTime >= 0, wait for any move it makes to complete and then
+// waitTime ms more.
+void runSerial(char *lineOut, int waitTime) {
+    serialSend(lineOut);
+    if (waitTime < 0)
+        return;
+
+    serialSend("M400"); // acknowledged once all moves have finished
+    serialFlush();
+    serialWait(waitTime);
+}
+
+// write out the queued layers and run the serial commands between them, for pipelined mode
+void *outputJobs(void *arg)
+{
+    struct outputJob *job;
+
+    while (1) {
+        pthread_mutex_lock(&jobLock);
+        while (jobHead == NULL && !jobsDone)
+            pthread_cond_wait(&jobCond, &jobLock);
+        job = jobHead;
+        pthread_mutex_unlock(&jobLock);
+        if (job == NULL)
+            break;
+
+        fwrite(job->samples.data, 1, job->samples.len, stdout);
+        fflush(stdout); // the samples have to be on their way before the Z-axis moves
+        if (job->lineOut)
+            runSerial(job->lineOut, job->waitTime);
+
+        // only take it off the queue once it's done, so the parser stays at most PIPELINE_DEPTH jobs ahead
+        pthread_mutex_lock(&jobLock);
+        jobHead = job->next;
+        if (jobHead == NULL)
+            jobTail = NULL;
+        jobCount--;
+        pthread_cond_signal(&jobCond);
+        pthread_mutex_unlock(&jobLock);
+
+        free(job->samples.data);
+        free(job->lineOut);
+        free(job);
+    }
+
+    return NULL;
+}
+
+// hand the samples so far and a serial command (or NULL) to the output thread
+void queueJob(char *lineOut, int waitTime)
+{
+    struct outputJob *job = malloc(sizeof(*job));
+
+    if (job == NULL || (lineOut && (lineOut = strdup(lineOut)) == NULL)) {
+        fprintf(stderr, "Error: out of memory for output job.\n");
+        exit(1);
+    }
+    job->samples = layerSamples;
+    job->lineOut = lineOut;
+    job->waitTime = waitTime;
+    job->next = NULL;
+    memset(&layerSamples, 0, sizeof(layerSamples));
+
+    pthread_mutex_lock(&jobLock);
+    while (jobCount > PIPELINE_DEPTH)
+        pthread_cond_wait(&jobCond, &jobLock);
+    if (jobTail)
+        jobTail->next = job;
+    else
+        jobHead = job;
+    jobTail = job;
+    jobCount++;
+    pthread_cond_signal(&jobCond);
+    pthread_mutex_unlock(&jobLock);
+}
+
 // send the z information out the serial port and wait for acknowledgment
 void sendSerial(char *lineOut, int waitTime) { // (float zVal, float feedrate) {
-    unsigned char buf[80];
-    int rdlen;
-    int wlen;
-
+    flushPaths();
     sendScaled(nowX, nowY, a_min, b_min, 0, 1); // turn off the laser
+    settleDue = 0; // the galvos have long settled by the time the printer board is done
 
-    lineNum++;
+    if (pipelined)
+        queueJob(lineOut, waitTime);
+    else
+        runSerial(lineOut, waitTime);
+}
 
-    wlen = write(fd, lineOut, strlen(lineOut));
-    if (wlen != strlen(lineOut)) {
-        printf("Error from write: %d, %d\n", wlen, errno);
-        exit(1);
+// read more of the g-code file in after the current line, which is moved to the front of the buffer.
+// The buffer grows when the line fills it. Returns the number of bytes read.
+size_t fillReader(struct gcodeReader *reader)
+{
+    size_t keep = reader->len - reader->pos;
+    size_t got;
+
+    memmove(reader->buf, reader->buf + reader->pos, keep);
+    reader->pos = 0;
+    reader->len = keep;
+
+    if (reader->size - reader->len < READ_CHUNK / 2) {
+        reader->size *= 2;
+        reader->buf = realloc(reader->buf, reader->size + 1);
+        if (reader->buf == NULL) {
+            fprintf(stderr, "Error: out of memory for a %lu byte line.\n", (unsigned long)keep);
+            exit(1);
+        }
+    }
+
+    got = fread(reader->buf + reader->len, 1, reader->size - reader->len, reader->file);
+    if (got == 0) {
+        if (ferror(reader->file))
+            fprintf(stderr, "Error reading file: %s\n", strerror(errno));
+        reader->eof = 1;
     }
-    tcdrain(fd); // delay for output
+    reader->len += got;
+    reader->buf[reader->len] = '\n'; // sentinel, so the tokenizer only checks for the end at newlines
+    return got;
+}
+
+int openReader(struct gcodeReader *reader, const char *path)
+{
+    reader->file = fopen(path, "r");
+    if (reader->file == NULL)
+        return -1;
+
+    reader->size = READ_CHUNK;
+    reader->buf = malloc(reader->size + 1);
+    if (reader->buf == NULL) {
+        fclose(reader->file);
+        return -1;
+    }
+    reader->pos = 0;
+    reader->len = 0;
+    reader->eof = 0;
+    reader->buf[0] = '\n';
+    return 0;
+}
+
+void closeReader(struct gcodeReader *reader)
+{
+    fclose(reader->file);
+    free(reader->buf);
+}
 
-    do { // wait for "ok xxx"
-        rdlen = read(fd, buf, sizeof(buf) - 1);
-        if (rdlen > 0) {
-            buf[rdlen] = 0;
-        } else if (rdlen < 0) {
-            printf("Error from read: %d: %s\n", rdlen, strerror(errno));
+// parse a plain decimal number, as used in g-code. Anything that isn't part of one is left alone.
+char *parseNumber(char *p, float *value)
+{
+    double val = 0;
+    double scale = 1;
+    int neg = 0;
+
+    if (*p == '-' || *p == '+')
+        neg = (*p++ == '-');
+    while (*p >= '0' && *p <= '9')
+        val = val * 10 + (*p++ - '0');
+    if (*p == '.') {
+        p++;
+        while (*p >= '0' && *p <= '9') {
+            val = val * 10 + (*p++ - '0');
+            scale *= 10;
         }
-        if (strstr(buf, "Resend")) {
-            write(fd, lineOut, strlen(lineOut));
-            tcdrain(fd);
+    }
+
+    *value = neg ? -val / scale : val / scale;
+    return p;
+}
+
+// split the next line of g-code into words, in one pass over the read buffer.
+// ';' comments run to the end of the line and '(' comments to the next ')'.
+// Returns 0 at the end of the file.
+int readLine(struct gcodeReader *reader, struct gcodeLine *line)
+{
+    char *p;
+    char *end;
+
+restart:
+    if (reader->eof && reader->pos == reader->len)
+        return 0;
+    p = reader->buf + reader->pos;
+    line->count = 0;
+
+    while (1) {
+        switch (*p) {
+        case '\n':
+            end = reader->buf + reader->len;
+            if (p == end && !reader->eof) { // the line carries on past what has been read so far
+                fillReader(reader);
+                goto restart;
+            }
+
+            *p = 0;
+            if (p > reader->buf + reader->pos && p[-1] == '\r')
+                p[-1] = 0;
+            line->text = reader->buf + reader->pos;
+            reader->pos = (p == end) ? reader->len : p - reader->buf + 1;
+            return 1;
+
+        case ';':
+            while (*p != '\n')
+                p++;
+            break;
+
+        case '(':
+            while (*p != ')' && *p != '\n')
+                p++;
+            if (*p == ')')
+                p++;
+            break;
+
+        default:
+            if (!isalpha((unsigned char)*p) && *p != '*') { // whitespace, or nothing we understand
+                p++;
+                break;
+            }
+
+            if (line->count == line->size) {
+                line->size = line->size ? line->size * 2 : 16;
+                line->words = realloc(line->words, line->size * sizeof(*line->words));
+                if (line->words == NULL) {
+                    fprintf(stderr, "Error: out of memory for %d words.\n", line->size);
+                    exit(1);
+                }
+            }
+            line->words[line->count].letter = toupper((unsigned char)*p++);
+            while (*p == ' ' || *p == '\t')
+                p++;
+            p = parseNumber(p, &line->words[line->count].value);
+            line->count++;
+            break;
         }
-    } while ((strstr(buf, "ok") == NULL) && (strstr(buf, "wait") == NULL)); //  || (strstr(buf, itoa(lineNum)) == NULL));
+    }
+}
+
+// look for the ";<z> L<layer>" comment at the start of each layer (must be set up in slic3r)
+int parseLayerComment(char *comment, float *layer)
+{
+    char *p = comment + 1;
+    char *end;
 
-    sleep(waitTime);
+    strtof(p, &end);
+    if (end == p) // no z
+        return 0;
+
+    p = end;
+    while (isspace((unsigned char)*p))
+        p++;
+    if (toupper((unsigned char)*p) != 'L')
+        return 0;
+
+    *layer = strtof(p + 1, NULL);
+    return 1;
 }
 
 // interpret the latest line of g-code
-void parseLine(char *thisLine)
+void parseLine(struct gcodeLine *line)
 {
-    char command[5];
-    float commandVal[5];
-    int newX = nowX;
-    int newY = nowY;
+    char *thisLine = line->text;
+    struct gcodeWord *words = line->words;
+    int count = line->count;
+    float layer;
+    int newX = posX;
+    int newY = posY;
     float newE = nowE;
     int laserOn = 0;
     float zVal;
@@ -292,39 +1147,45 @@ void parseLine(char *thisLine)
     int sendZMove = 0;
     int i;
 
-    // initialize to zero
-    for (i=0; i < 5; i++) {
-        command[i] = 0;
-        commandVal[i] = 0;
+    if (count > 0 && words[0].letter == 'N') { // skip the line number, if there is one
+        words++;
+        count--;
     }
 
-    sscanf(thisLine, "%c%f %c%f %c%f %c%f %c%f %c%f", &command[0], &commandVal[0], &command[1], &commandVal[1], &command[2], &commandVal[2], &command[3], &commandVal[3], &command[4], &commandVal[4], &command[5], &commandVal[5]);
+    if (count == 0) {
+        if (thisLine[0] == ';' && parseLayerComment(thisLine, &layer)) // catch first layer
+        {
+            flushPaths(); // the last layer is drawn as it was exposed
+            if (layer < LAYER_STICK) superStick = 1; // look for first LAYER_STICK layers
+            else superStick = 0;
+        }
+    }
 
-    if (toupper(command[0]) == 'G') // a G command has been sent
+    else if (words[0].letter == 'G') // a G command has been sent
     {
-        if (commandVal[0] <= 1)     // G0 or G1 means "move"
+        if (words[0].value <= 1)     // G0 or G1 means "move"
         {
-            for (i=1; (i < 5) && (command[i] != ';'); i++) // get out if there's a comment
+            for (i=1; i < count; i++)
             {
-                switch(toupper(command[i])) {
+                switch(words[i].letter) {
                 case 'X': // new X location
-                    newX = pixelize(commandVal[i]);
-                    if (!abs_pos) newX += nowX;
+                    newX = pixelize(words[i].value);
+                    if (!abs_pos) newX += posX;
                     break;
                 case 'Y': // new Y location
-                    newY = pixelize(-commandVal[i]);
-                    if (!abs_pos) newY += nowY;
+                    newY = pixelize(-words[i].value);
+                    if (!abs_pos) newY += posY;
                     break;
                 case 'Z': // there is a z-move.  Store the z-value and flag to send it over serial
-                    zVal = commandVal[i];
+                    zVal = words[i].value;
                     sendZMove = 1;
                     break;
                 case 'F': // feedrate.  Store this in case of z-move (not used with laser)
-                    feedrate = commandVal[i];
+                    feedrate = words[i].value;
                     break;
                 case 'E': // extrusion setting. Turn on the laser if this is a forward extrusion
                             // note - only absolute mode is currently supported. Need a plan for relative.
-                    newE = commandVal[i];
+                    newE = words[i].value;
                     if (newE > nowE) laserOn = 1;
                     nowE = newE;
                     break;
@@ -335,50 +1196,50 @@ void parseLine(char *thisLine)
 
             if (sendZMove) { // if a z-move was specified
                 if (superStick)
-                    sendSerial(thisLine, Z_DELAY * 3); // send the new Z value and wait (longer for first layers)
+                    sendSerial(thisLine, zSettle * 3); // send the new Z value and wait (longer for first layers)
                 else
-                    sendSerial(thisLine, Z_DELAY); // send the new z value and the feedrate out serially
+                    sendSerial(thisLine, zSettle); // send the new z value and the feedrate out serially
             }
 
             else { // the actual "move the laser" command
-                moveLaser(newX, newY, laserOn);
+                if (optimize)
+                    addMove(newX, newY, laserOn);
+                else
+                    moveLaser(newX, newY, laserOn);
+                posX = newX;
+                posY = newY;
             }
         }
 
-        else if (commandVal[0] == 28) { // home command
+        else if (words[0].value == 28) { // home command
+            flushPaths();
             sendScaled(nowX, nowY, a_min, b_min, 0, 1); // turn off the laser
-            sendSerial(thisLine, HOME_DELAY);
+            sendSerial(thisLine, 0); // wait for it to finish
         }
 
-        else if (commandVal[0] == 90) { // set to absolute positioning
+        else if (words[0].value == 90) { // set to absolute positioning
             abs_pos = 1;
-            sendSerial(thisLine, 0);
+            sendSerial(thisLine, -1);
         }
 
-        else if (commandVal[0] == 91) { // set to relative positioning
+        else if (words[0].value == 91) { // set to relative positioning
             abs_pos = 0;
-            sendSerial(thisLine, 0);
+            sendSerial(thisLine, -1);
         }
 
-        else if (commandVal[0] == 92) { // resetting the extruder position
-            for (i=1; (i < 5) && (command[i] != ';'); i++) // get out if there's a comment
+        else if (words[0].value == 92) { // resetting the extruder position
+            for (i=1; i < count; i++)
             {
-                if (toupper(command[i]) == 'E')
-                    nowE = commandVal[i];
+                if (words[i].letter == 'E')
+                    nowE = words[i].value;
             }
         }
     }
-    else if (toupper(command[0]) == 'M') // an M command has been sent
+    else if (words[0].letter == 'M') // an M command has been sent
 //    {
-//        if (commandVal[0] == 18) // M18 means turn off power to motors
-            sendSerial(thisLine, 0); // send it to the RAMPS board
+//        if (words[0].value == 18) // M18 means turn off power to motors
+            sendSerial(thisLine, -1); // send it to the RAMPS board
 //    }
-
-    else if (toupper(command[0]) == ';') // catch first layer (must be set up in slic3r)
-    {
-	if ((toupper(command[1]) == 'L') && (commandVal[1] < LAYER_STICK)) superStick = 1; // look for first LAYER_STICK layers
-        else if (toupper(command[1]) == 'L') superStick = 0;
-    }
     return;
 }
 
@@ -388,13 +1249,10 @@ int main (int argc, char *argv[])
     int rate = 20000;
 
     char * path = FILENAME; // the path of the g-code file passed in at the command prompt
-    FILE * file; // the contents of the g-code file passed in at command prompt
-    char thisLine[60]; // the current line we are parsing
-    unsigned char lineOut[80]; // the string to be sent out the serial port
+    struct gcodeReader reader; // the contents of the g-code file passed in at command prompt
+    struct gcodeLine line = {0}; // the current line we are parsing
     char * portname = PORTNAME;
-    unsigned char buf[80];
-    int wlen;
-    int rdlen;
+    long long deadline;
 
     int aflag = 0;
     int Aflag = 0;
@@ -409,9 +1267,14 @@ int main (int argc, char *argv[])
     int rflag = 0;
     int hflag = 0;
     int pflag = 0;
+    int Pflag = 0;
+    int sflag = 0;
+    int Oflag = 0;
+    int Jflag = 0;
+    int Wflag = 0;
 
     opterr_portable = 1;
-    while (-1 != (c = getopt_portable(argc, argv, "a:A:b:B:hD:X:Y:M:E:f:p:r:"))) { // parsing the command line variables
+    while (-1 != (c = getopt_portable(argc, argv, "a:A:b:B:hD:X:Y:M:E:f:p:r:Ps:OJ:W:"))) { // parsing the command line variables
         switch(c) {
         case 'a':
             aflag++;
@@ -464,6 +1327,26 @@ int main (int argc, char *argv[])
             rflag++;
             rate = atoi(optarg_portable);
             break;
+        case 'P':
+            Pflag++;
+            pipelined = 1;
+            break;
+        case 's':
+            sflag++;
+            zSettle = atoi(optarg_portable);
+            break;
+        case 'O':
+            Oflag++;
+            optimize = 1;
+            break;
+        case 'J':
+            Jflag++;
+            jumpStep = atoi(optarg_portable);
+            break;
+        case 'W':
+            Wflag++;
+            jumpDwell = atoi(optarg_portable);
+            break;
         default:
             print_help(argv[0], stderr);
             exit(1);
@@ -473,7 +1356,8 @@ int main (int argc, char *argv[])
     // error handling
     if (aflag > 1 || Aflag > 1 || bflag > 1 || Bflag > 1 ||
             hflag > 1 || Dflag > 1 || Xflag > 1 || Yflag > 1
-            || Mflag > 1 || Eflag > 1 || rflag > 1 || fflag > 1 || pflag > 1) {
+            || Mflag > 1 || Eflag > 1 || rflag > 1 || fflag > 1 || pflag > 1 || Pflag > 1 || sflag > 1 || Oflag > 1
+            || Jflag > 1 || Wflag > 1) {
         fprintf(stderr, "Cannot specify flags more than once.\n");
         print_help(argv[0], stderr);
         exit(1);
@@ -516,6 +1400,18 @@ int main (int argc, char *argv[])
         }
     }
 
+    if (zSettle < 0) {
+        fprintf(stderr, "Z settle time cannot be negative\n");
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
+    if (jumpStep < 0 || jumpDwell < 0) {
+        fprintf(stderr, "Jump step and dwell cannot be negative\n");
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
     if (rate < 0 || rate > 30000) {
         fprintf(stderr, "Rate must be between 1 and 30,000\n");
         print_help(argv[0], stderr);
@@ -537,62 +1433,20 @@ int main (int argc, char *argv[])
     //baudrate 115200, 8 bits, no parity, 1 stop bit
     set_interface_attribs(fd, BAUDRATE);
 
-    // initialize the serial port
-    sprintf(lineOut, "N%d M110 N%d\n", lineNum, lineNum);
-    wlen = write(fd, lineOut, strlen(lineOut));
-    if (wlen != strlen(lineOut)) {
-        printf("Error from write: %d, %d\n", wlen, errno);
-        return -1;
-    }
-    tcdrain(fd);  // delay for output
-// printf("Sent: %s", lineOut);
-
-    do { // wait for "wait"
-        rdlen = read(fd, buf, sizeof(buf) - 1);
-        if (rdlen > 0) {
-            buf[rdlen] = 0;
-// printf("Read: %s\n", buf);
-        } else if (rdlen < 0) {
-            printf("Error from read: %d: %s\n", rdlen, strerror(errno));
-        }
-    } while (strstr(buf, "wait") == NULL);
-
-    do { // wait for second "wait"
-        rdlen = read(fd, buf, sizeof(buf) - 1);
-        if (rdlen > 0) {
-            buf[rdlen] = 0;
-// printf("Read: %s\n", buf);
-        } else if (rdlen < 0) {
-            printf("Error from read: %d: %s\n", rdlen, strerror(errno));
-        }
-    } while (strstr(buf, "wait") == NULL);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
-    wlen = write(fd, lineOut, strlen(lineOut)); // set initial line number to 0 again
-    if (wlen != strlen(lineOut)) {
-        printf("Error from write: %d, %d\n", wlen, errno);
-        return -1;
-    }
-    tcdrain(fd);  // delay for output
-// printf("Sent: %s", lineOut);
+    // give the board a chance to come up, in case opening the port reset it
+    deadline = nowMs() + BOOT_TIMEOUT;
+    while (!serialReady && nowMs() < deadline)
+        serialPoll(deadline - nowMs());
 
-    do { // wait for "ok"
-        rdlen = read(fd, buf, sizeof(buf) - 1);
-        if (rdlen > 0) {
-            buf[rdlen] = 0;
-// printf("Read: %s\n", buf);
-        } else if (rdlen < 0) {
-            printf("Error from read: %d: %s\n", rdlen, strerror(errno));
-        }
-        if (strstr(buf, "Resend")) {
-            write(fd, lineOut, strlen(lineOut)); // resend
-            tcdrain(fd);
-// printf("Sent: %s", lineOut);
-        }
-    } while (strstr(buf, "ok") == NULL);
+    // initialize the serial port
+    lineNum = 0;
+    serialSend("M110 N0"); // restart the board's line numbering
+    serialFlush();
 
     // open the g-code file
-    file = fopen (path, "r");
-    if (file == NULL) {
+    if (openReader(&reader, path) < 0) {
         fprintf(stderr, "Error: can't open file.\n");
         return 1;
     }
@@ -601,12 +1455,36 @@ int main (int argc, char *argv[])
     printf("r=%d\n", rate);
     printf("e=1\n");
 
+    if (pipelined) {
+        fflush(stdout);
+        if (pthread_create(&outputThread, NULL, outputJobs, NULL)) {
+            fprintf(stderr, "Error: can't start output thread.\n");
+            return 1;
+        }
+    }
+
     // loop through, looking for parse-able commands
-    while (fgets(thisLine, 60, file)!=NULL) {
-        parseLine(thisLine);
+    while (readLine(&reader, &line)) {
+        parseLine(&line);
+    }
+    flushPaths();
+
+    if (optimize && travelBefore > 0)
+        fprintf(stderr, "Path optimization saved %lld of %lld blanked travel steps (%.1f%%)\n",
+                travelBefore - travelAfter, travelBefore, 100.0 * (travelBefore - travelAfter) / travelBefore);
+
+    if (pipelined) { // write out whatever is left and wait for it
+        queueJob(NULL, 0);
+        pthread_mutex_lock(&jobLock);
+        jobsDone = 1;
+        pthread_cond_signal(&jobCond);
+        pthread_mutex_unlock(&jobLock);
+        pthread_join(outputThread, NULL);
     }
 
-    fclose(file);
+    closeReader(&reader);
+    free(line.words);
+    serialFlush();
     close(fd);
 
     // closing
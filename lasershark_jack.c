@@ -29,49 +29,256 @@ along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 #include <libusb.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "lasersharklib/lasershark_lib.h"
+#include "getopt_portable.h"
 
 
 #define LASERSHARK_VIN 0x1fc9
 #define LASERSHARK_PID 0x04d8
 
-int do_exit = 0;
-pid_t pid;
+volatile sig_atomic_t do_exit = 0;
+// quit_program() wakes main() through quit_cond. SIGINT only sets do_exit, main() checks it every
+// QUIT_POLL_MS.
+#define QUIT_POLL_MS 100
+pthread_mutex_t quit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t quit_cond = PTHREAD_COND_INITIALIZER;
 
 jack_client_t *client;
 
 typedef jack_default_audio_sample_t sample_t;
 typedef jack_nframes_t nframes_t;
 
-jack_port_t *in_x;
-jack_port_t *in_y;
-jack_port_t *in_r;
-jack_port_t *in_g;
-jack_port_t *in_b;
-
 nframes_t rate;
 
-// Number of laserjack data packets the ringbuffer will have space for.
+// Number of laserjack data packets each unit's ringbuffer will have space for.
 #define JACK_RB_PACKETS 256
-jack_ringbuffer_t *jack_rb = NULL;
-uint32_t jack_rb_len = 0;
 
-uint8_t *laserjack_iso_data_packet_buf = NULL;
-int laserjack_iso_data_packet_len = 0;
+// In adaptive mode process() keeps no more than a unit's jack_rb_target bytes queued, counting its jack_rb,
+// transfers in flight and the device's ringbuffer, on top of the period it is writing. The unit's USB worker
+// raises the target a transfer at a time whenever the device runs dry, up to the latency budget, and lowers
+// it a packet at a time after every quiet ADAPT_INTERVAL_MS.
+#define ADAPT_INTERVAL_MS 1000
+uint32_t latency_budget_ms = 0; // 0 turns adaptive mode off
+
+// The USB workers read their device's ringbuffer fill this often when adaptive mode, stats or drift
+// compensation need it.
+#define DEVICE_POLL_MS 50
+int poll_device = 0;
+
+// Drift compensation keeps each unit's queue level where it settled after DRIFT_SETTLE_MS of streaming by
+// nudging its resampling step. The queue level is smoothed over DRIFT_SMOOTH_MS and fed to a critically
+// damped PI loop with a DRIFT_TIME_CONSTANT_MS time constant. Whatever the integral term settles at is the
+// drift between the JACK and device clocks. It can't be combined with adaptive mode: a step correction of
+// at most DRIFT_MAX_PPM drains the queue far slower than a late period or a stalled transfer fills it, so
+// the adaptive target would have to be kept by dropping samples, and the drops would fight the loop.
+#define DRIFT_SETTLE_MS 10000
+#define DRIFT_SMOOTH_MS 2000
+#define DRIFT_TIME_CONSTANT_MS 20000
+#define DRIFT_MAX_PPM 1000
+int drift_compensation = 0;
+
+// Each ISO transfer carries this many data packets, filled from jack_rb in one read.
+#define ISO_PACKETS_MIN 8
+#define ISO_PACKETS_MAX 32
+#define ISO_PACKETS_DEFAULT 8
+int iso_packets_per_transfer = ISO_PACKETS_DEFAULT;
+
+// Data packets in each unit's transfer pool, shared out between however many transfers that makes.
+// Each transfer is either on the bus or waiting in the unit's iso_free_rb.
+#define ISO_POOL_PACKETS 128
+#define ISO_TRANSFER_COUNT_MAX (ISO_POOL_PACKETS/ISO_PACKETS_MIN)
+int iso_transfer_count = 0;
+
+// All libusb event handling, and so every completion callback, happens on this thread.
+#define USB_EVENTS_TIMEOUT_MS 100
+#define USB_DRAIN_TIMEOUT_MS 1000
+pthread_t usb_events_tid;
+int usb_events_stop = 0;
+int usb_events_running = 0;
+
+// Each frame becomes this many uint16_t elements in jack_rb, see convert_frames() for the layout.
+#define LASERJACK_FRAME_ELEMENTS 4
+
+// Scale and offset that take JACK samples to DAC values, set once the DAC range is known.
+// x and y span -1.0 to 1.0, the colour channels 0.0 to 1.0.
+struct dac_conversion
+{
+    float xy_scale, xy_offset;
+    float rgb_scale, rgb_offset;
+    float lo, hi;
+    uint32_t c_threshold; // Blue at or above this turns the C ttl output on
+};
+
+// Linear interpolation from the JACK rate to the ILDA rate. Positions are in JACK frames, 32.32 fixed
+// point, counted from the last frame of the previous period.
+#define RESAMPLE_ONE ((uint64_t)1 << 32)
+#define RESAMPLE_CHUNK 256
+struct resampler
+{
+    uint64_t pos; // Next output position
+    sample_t last[5]; // x, y, r, g, b at the end of the previous period
+    sample_t out[5][RESAMPLE_CHUNK];
+};
+// JACK frames per ILDA frame. Set by srate(), picked up by process() at the start of a period.
+atomic_uint_fast64_t resample_step = RESAMPLE_ONE;
+
+#define MAX_UNITS 8
+
+// One Lasershark and everything that feeds it. process() fills every unit's jack_rb from its own ports,
+// and each unit has its own USB worker to send it on.
+struct laserjack_unit
+{
+    int index;
+    unsigned char serialnum[64];
+    struct libusb_device_handle *devh_ctl;
+    struct libusb_device_handle *devh_data;
+    int ctl_claimed;
+    int data_claimed;
+
+    uint32_t fw_major_version;
+    uint32_t fw_minor_version;
+    uint32_t iso_packet_sample_count;
+    uint32_t samp_element_count;
+    uint32_t max_ilda_rate;
+    uint32_t dac_min_val;
+    uint32_t dac_max_val;
+    uint32_t ringbuffer_sample_count;
+    uint32_t max_iso_data_len;
+    struct dac_conversion conv;
+
+    jack_port_t *in_x;
+    jack_port_t *in_y;
+    jack_port_t *in_r;
+    jack_port_t *in_g;
+    jack_port_t *in_b;
+    struct resampler resampler;
+
+    jack_ringbuffer_t *jack_rb;
+    uint32_t jack_rb_len;
+    uint32_t jack_rb_budget;
+    uint32_t jack_rb_floor;
+    atomic_uint jack_rb_target;
+    atomic_uint queued_beyond_rb; // Bytes in flight and in the device, as last seen by the USB worker
+    uint32_t device_fill; // Samples in the device at the last reading, only used by the USB worker
+
+    // Drift compensation, only used by the USB worker apart from step_correction.
+    double drift_level; // Smoothed frames queued
+    double drift_setpoint;
+    double drift_integral; // Step correction making up for the drift, as a fraction of the step
+    uint64_t drift_start; // When the unit started streaming, 0 until then
+    uint64_t drift_last;
+    // Added to resample_step by process() for this unit, 32.32 fixed point like the step itself.
+    atomic_int_fast64_t step_correction;
+
+    int iso_data_packet_len;
+    int iso_transfer_len;
+    struct libusb_transfer *iso_transfers[ISO_TRANSFER_COUNT_MAX];
+    uint8_t *iso_transfer_bufs;
+    // Idle transfers. Written by the completion callback, read by the USB worker, so no locking is needed.
+    jack_ringbuffer_t *iso_free_rb;
+
+    // The USB worker moves data from jack_rb to the Lasershark so process() never calls into libusb.
+    // process() only ever trylocks usb_worker_lock to wake it. jack_rb is read and transfers are submitted
+    // only with usb_worker_lock held, by the USB worker or by a completion callback resubmitting its
+    // transfer. Once usb_draining is set nothing is submitted.
+    pthread_t usb_worker_tid;
+    pthread_mutex_t usb_worker_lock;
+    pthread_cond_t usb_worker_cond;
+    int usb_worker_running;
+    int usb_draining;
+
+    // Live metrics, printed to stats_file every LOG_INTERVAL_MS by the log thread.
+    atomic_uint stat_transfers; // ISO transfers completed
+    atomic_uint stat_dropped; // Frames process() had no room for
+    atomic_uint stat_iso_errors; // Failed ISO transfers and packets
+    atomic_uint stat_underruns; // Times the device's ringbuffer was found empty while streaming
+    atomic_uint stat_device_fill; // Samples in the device's ringbuffer at the last reading
+    // Frames queued in jack_rb, in flight and in the device, as seen by the USB worker since the last report.
+    atomic_uint stat_queued_min;
+    atomic_uint stat_queued_max;
+    atomic_int stat_drift_ppb; // Estimated drift of the device clock against JACK's
+    unsigned int prev_transfers, prev_dropped, prev_iso_errors, prev_underruns;
+
+    // Latency reported on the unit's input ports, in JACK frames.
+    atomic_uint port_latency_min;
+    atomic_uint port_latency_max;
+};
+
+struct laserjack_unit units[MAX_UNITS];
+int unit_count = 0;
+
+// Problems seen while streaming. The threads that must not block (process(), the USB workers and
+// completion callbacks) report them with log_event() and the log thread prints them.
+enum log_event_type
+{
+    LOG_RINGBUFFER_FULL,
+    LOG_RINGBUFFER_READ_FAIL,
+    LOG_SUBMIT_FAIL,
+    LOG_ISO_TRANSFER_ERR,
+    LOG_ISO_PACKET_ERR,
+    LOG_HANDLE_EVENTS_FAIL,
+    LOG_EVENT_TYPES
+};
+
+struct log_event_desc
+{
+    const char *name;
+    const char *details; // printf format for the record's a and b
+};
 
-int lasershark_serialnum_len = 64;
-unsigned char lasershark_serialnum[64];
-uint32_t lasershark_fw_major_version = 0;
-uint32_t lasershark_fw_minor_version = 0;
+const struct log_event_desc log_events[LOG_EVENT_TYPES] =
+{
+    [LOG_RINGBUFFER_FULL] = {"Ringbuffer full", ", dropped %d samples"},
+    [LOG_RINGBUFFER_READ_FAIL] = {"Ringbuffer read failure", ""},
+    [LOG_SUBMIT_FAIL] = {"Could not submit transfer", ": rc=%d"},
+    [LOG_ISO_TRANSFER_ERR] = {"ISO transfer err", ": %d   bytes transferred: %d"},
+    [LOG_ISO_PACKET_ERR] = {"ISO packet err", ": %d   bytes transferred: %d"},
+    [LOG_HANDLE_EVENTS_FAIL] = {"Handling USB events failed", ": %d"},
+};
+
+// Each reporting thread has its own queue, so every queue has a single writer. There is one
+// LOG_FROM_USB_WORKER queue per unit, covering everything done with that unit's usb_worker_lock held.
+enum log_source
+{
+    LOG_FROM_PROCESS,
+    LOG_FROM_USB_EVENTS,
+    LOG_FROM_USB_WORKER,
+    LOG_SOURCES = LOG_FROM_USB_WORKER + MAX_UNITS
+};
 
+struct log_record
+{
+    int type;
+    int unit; // Index into units, or -1
+    int a, b;
+};
+
+// Only the first occurrence of an event in each LOG_INTERVAL_MS is queued with its details,
+// the rest are just counted.
+#define LOG_QUEUE_RECORDS 64
+#define LOG_INTERVAL_MS 1000
+jack_ringbuffer_t *log_rbs[LOG_SOURCES];
+atomic_uint log_counts[LOG_EVENT_TYPES];
+pthread_t log_tid;
+atomic_int log_stop;
+int log_running = 0;
+
+FILE *stats_file = NULL;
+
+// Keeps the log thread from asking JACK to recompute latencies while the client is being closed.
+pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
 
-uint32_t lasershark_iso_packet_sample_count;
-uint32_t lasershark_samp_element_count;
-uint32_t lasershark_max_ilda_rate;
-uint32_t lasershark_dac_min_val;
-uint32_t lasershark_dac_max_val;
+int lasershark_serialnum_len = 64;
 
-uint32_t lasershark_ringbuffer_sample_count;
+// Lowest maximum of all the units, they all run at the same ILDA rate.
+uint32_t lasershark_max_ilda_rate;
 
 uint32_t lasershark_ilda_rate = 0;
 
@@ -80,13 +287,6 @@ typedef struct
     float x, y, r, g, b;
 } bufsample_t;
 
-struct libusb_device_handle *devh_ctl = NULL;
-struct libusb_device_handle *devh_data = NULL;
-uint32_t max_iso_data_len = 0;
-
-
-sigset_t mask, oldmask;
-
 
 
 static void sig_hdlr(int signum)
@@ -97,10 +297,6 @@ static void sig_hdlr(int signum)
         printf("\nGot request to quit\n");
         do_exit = 1;
         break;
-    case SIGUSR1:
-        printf("sigusr1 caught\n");
-        do_exit = 1;
-        break;
     default:
         printf("what\n");
     }
@@ -109,364 +305,1631 @@ static void sig_hdlr(int signum)
 
 void quit_program()
 {
-    kill(pid, SIGUSR1);
+    pthread_mutex_lock(&quit_lock);
+    do_exit = 1;
+    pthread_cond_signal(&quit_cond);
+    pthread_mutex_unlock(&quit_lock);
+}
+
+
+static void deadline_in_ms(struct timespec *ts, uint32_t ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms/1000;
+    ts->tv_nsec += (long)(ms%1000)*1000000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+
+/*
+Reports an event without blocking, safe to call from process(). unit may be NULL.
+*/
+static void log_event(int source, struct laserjack_unit *unit, enum log_event_type type, int a, int b)
+{
+    struct log_record record = {type, unit ? unit->index : -1, a, b};
+
+    if (unit && type == LOG_RINGBUFFER_FULL)
+    {
+        atomic_fetch_add_explicit(&unit->stat_dropped, a, memory_order_relaxed);
+    }
+    else if (unit && (type == LOG_ISO_TRANSFER_ERR || type == LOG_ISO_PACKET_ERR))
+    {
+        atomic_fetch_add_explicit(&unit->stat_iso_errors, 1, memory_order_relaxed);
+    }
+
+    if (atomic_fetch_add_explicit(&log_counts[type], 1, memory_order_relaxed) != 0)
+    {
+        return;
+    }
+
+    // Never write part of a record. If the queue is full the event still shows up in the counts.
+    if (jack_ringbuffer_write_space(log_rbs[source]) >= sizeof(record))
+    {
+        jack_ringbuffer_write(log_rbs[source], (const char*)&record, sizeof(record));
+    }
+}
+
+
+static void drain_log()
+{
+    struct log_record record;
+    int i;
+
+    for (i = 0; i < LOG_SOURCES && log_rbs[i] != NULL; i++)
+    {
+        while (jack_ringbuffer_read(log_rbs[i], (char*)&record, sizeof(record)) == sizeof(record))
+        {
+            if (unit_count > 1 && record.unit >= 0)
+            {
+                printf("%s: ", units[record.unit].serialnum);
+            }
+            printf("%s", log_events[record.type].name);
+            printf(log_events[record.type].details, record.a, record.b);
+            printf("\n");
+        }
+    }
+    fflush(stdout);
+}
+
+
+/*
+Summarises the repeats and lets the next occurrence of each event be queued again.
+*/
+static void report_log_repeats()
+{
+    unsigned int count;
+    int i;
+
+    for (i = 0; i < LOG_EVENT_TYPES; i++)
+    {
+        count = atomic_exchange_explicit(&log_counts[i], 0, memory_order_relaxed);
+        if (count > 1)
+        {
+            printf("%s repeated %u more times\n", log_events[i].name, count - 1);
+        }
+    }
+    fflush(stdout);
+}
+
+
+static uint32_t frames_to_ms(uint32_t frames)
+{
+    return lasershark_ilda_rate ? (uint32_t)((uint64_t)frames*1000/lasershark_ilda_rate) : 0;
+}
+
+
+/*
+Works out the latency to report on a unit's input ports from how much it had queued. Returns 1 if it has
+moved by more than a packet since it was last reported.
+*/
+static int update_port_latency(struct laserjack_unit *unit, uint32_t queued_min, uint32_t queued_max)
+{
+    uint32_t packet = unit->iso_packet_sample_count;
+    uint32_t old_min = atomic_load(&unit->port_latency_min);
+    uint32_t old_max = atomic_load(&unit->port_latency_max);
+    uint32_t lat_min, lat_max;
+
+    if (!lasershark_ilda_rate || queued_min > queued_max)
+    {
+        return 0;
+    }
+
+    lat_min = (uint64_t)queued_min*rate/lasershark_ilda_rate;
+    lat_max = (uint64_t)queued_max*rate/lasershark_ilda_rate;
+    if (lat_min + packet > old_min && lat_min < old_min + packet &&
+            lat_max + packet > old_max && lat_max < old_max + packet)
+    {
+        return 0;
+    }
+
+    atomic_store(&unit->port_latency_min, lat_min);
+    atomic_store(&unit->port_latency_max, lat_max);
+    return 1;
+}
+
+
+static void report_unit_stats(struct laserjack_unit *unit, uint32_t queued_min, uint32_t queued_max)
+{
+    unsigned int transfers, dropped, iso_errors, underruns;
+    uint32_t frame_len = LASERJACK_FRAME_ELEMENTS*sizeof(uint16_t);
+    uint32_t fill;
+
+    transfers = atomic_load_explicit(&unit->stat_transfers, memory_order_relaxed);
+    dropped = atomic_load_explicit(&unit->stat_dropped, memory_order_relaxed);
+    iso_errors = atomic_load_explicit(&unit->stat_iso_errors, memory_order_relaxed);
+    underruns = atomic_load_explicit(&unit->stat_underruns, memory_order_relaxed);
+    fill = jack_ringbuffer_read_space(unit->jack_rb)/frame_len;
+
+    fprintf(stats_file, "stats");
+    if (unit_count > 1)
+    {
+        fprintf(stats_file, " %s", unit->serialnum);
+    }
+    fprintf(stats_file, ": ringbuffer %u/%u samples (%u ms), device %u/%u", fill, unit->jack_rb_len/frame_len,
+            frames_to_ms(fill), atomic_load_explicit(&unit->stat_device_fill, memory_order_relaxed),
+            unit->ringbuffer_sample_count);
+    if (latency_budget_ms)
+    {
+        fprintf(stats_file, ", target %u ms", frames_to_ms(atomic_load(&unit->jack_rb_target)/frame_len));
+    }
+    if (drift_compensation)
+    {
+        fprintf(stats_file, ", drift %+.1f ppm", atomic_load_explicit(&unit->stat_drift_ppb, memory_order_relaxed)/1000.0);
+    }
+    if (queued_min <= queued_max)
+    {
+        fprintf(stats_file, ", latency %u-%u ms", frames_to_ms(queued_min), frames_to_ms(queued_max));
+    }
+    fprintf(stats_file, ", %u transfers, %u dropped samples, %u ISO errors, %u underruns\n",
+            transfers - unit->prev_transfers, dropped - unit->prev_dropped, iso_errors - unit->prev_iso_errors,
+            underruns - unit->prev_underruns);
+
+    unit->prev_transfers = transfers;
+    unit->prev_dropped = dropped;
+    unit->prev_iso_errors = iso_errors;
+    unit->prev_underruns = underruns;
+}
+
+
+static void report_stats()
+{
+    uint32_t queued_min, queued_max;
+    int latency_changed = 0;
+    int i;
+
+    for (i = 0; i < unit_count; i++)
+    {
+        if (units[i].jack_rb == NULL)
+        {
+            continue;
+        }
+
+        queued_min = atomic_exchange(&units[i].stat_queued_min, UINT32_MAX);
+        queued_max = atomic_exchange(&units[i].stat_queued_max, 0);
+        latency_changed |= update_port_latency(&units[i], queued_min, queued_max);
+
+        if (stats_file != NULL)
+        {
+            report_unit_stats(&units[i], queued_min, queued_max);
+        }
+    }
+    if (stats_file != NULL)
+    {
+        fflush(stats_file);
+    }
+
+    if (latency_changed)
+    {
+        pthread_mutex_lock(&client_lock);
+        if (client)
+        {
+            jack_recompute_total_latencies(client);
+        }
+        pthread_mutex_unlock(&client_lock);
+    }
+}
+
+
+static void *log_thread(void *arg)
+{
+    struct timespec tick = {0, LOG_INTERVAL_MS*1000000L/10};
+    int ticks = 0;
+
+    while (!atomic_load(&log_stop))
+    {
+        nanosleep(&tick, NULL);
+        drain_log();
+        if (++ticks == 10)
+        {
+            report_log_repeats();
+            report_stats();
+            ticks = 0;
+        }
+    }
+
+    return NULL;
+}
+
+
+static int start_log_thread()
+{
+    int i;
+
+    for (i = 0; i < LOG_SOURCES; i++)
+    {
+        log_rbs[i] = jack_ringbuffer_create(sizeof(struct log_record)*LOG_QUEUE_RECORDS);
+        if (log_rbs[i] == NULL)
+        {
+            return LASERSHARK_CMD_FAIL;
+        }
+    }
+    for (i = 0; i < LOG_EVENT_TYPES; i++)
+    {
+        atomic_init(&log_counts[i], 0);
+    }
+    atomic_init(&log_stop, 0);
+
+    if (pthread_create(&log_tid, NULL, log_thread, NULL))
+    {
+        return LASERSHARK_CMD_FAIL;
+    }
+    log_running = 1;
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+/*
+Stops the log thread and prints whatever was still queued. Everything that calls log_event() must
+have stopped first.
+*/
+static void stop_log_thread()
+{
+    int i;
+
+    if (log_running)
+    {
+        atomic_store(&log_stop, 1);
+        pthread_join(log_tid, NULL);
+        log_running = 0;
+    }
+
+    drain_log();
+    report_log_repeats();
+    for (i = 0; i < LOG_SOURCES; i++)
+    {
+        if (log_rbs[i] != NULL)
+        {
+            jack_ringbuffer_free(log_rbs[i]);
+            log_rbs[i] = NULL;
+        }
+    }
 }
 
+int write_lasershark_data(struct laserjack_unit *unit, struct libusb_transfer *transfer);
+
+
+static int iso_transfers_in_flight(struct laserjack_unit *unit)
+{
+    return iso_transfer_count - jack_ringbuffer_read_space(unit->iso_free_rb)/sizeof(struct libusb_transfer*);
+}
+
+
 /*
-Internal callback for cleaning up async writes.
+Internal callback for async writes. If there is enough data the transfer is refilled and resubmitted
+straight away, otherwise it goes back to the pool for the USB worker.
  */
 void
 WriteAsyncCallback(struct libusb_transfer *transfer)
 {
-    if (transfer && (transfer->status != LIBUSB_TRANSFER_COMPLETED/* || transfer->actual_length != transfer->length*/))
+    struct laserjack_unit *unit = transfer->user_data;
+    int i;
+
+    // Cancelling is only done while draining at shutdown, so isn't worth reporting.
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED/* || transfer->actual_length != transfer->length*/)
+    {
+        log_event(LOG_FROM_USB_EVENTS, unit, LOG_ISO_TRANSFER_ERR, transfer->status, transfer->actual_length);
+    }
+    else if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+    {
+        // A completed transfer can still have individual packets that failed.
+        for (i = 0; i < transfer->num_iso_packets; i++)
+        {
+            if (transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED)
+            {
+                log_event(LOG_FROM_USB_EVENTS, unit, LOG_ISO_PACKET_ERR,
+                          transfer->iso_packet_desc[i].status, transfer->iso_packet_desc[i].actual_length);
+            }
+        }
+    }
+    atomic_fetch_add_explicit(&unit->stat_transfers, 1, memory_order_relaxed);
+
+    pthread_mutex_lock(&unit->usb_worker_lock);
+    if (!unit->usb_draining && !do_exit && jack_ringbuffer_read_space(unit->jack_rb) >= unit->iso_transfer_len)
+    {
+        if (write_lasershark_data(unit, transfer) == LASERSHARK_CMD_SUCCESS)
+        {
+            pthread_mutex_unlock(&unit->usb_worker_lock);
+            return;
+        }
+        quit_program();
+    }
+
+    // Anyone waiting for transfers to come back gets woken.
+    jack_ringbuffer_write(unit->iso_free_rb, (const char*)&transfer, sizeof(transfer));
+    pthread_cond_signal(&unit->usb_worker_cond);
+    pthread_mutex_unlock(&unit->usb_worker_lock);
+}
+
+
+/*
+Allocates a unit's ISO transfers and their buffers up front, so nothing is allocated while streaming.
+*/
+int alloc_iso_transfers(struct laserjack_unit *unit)
+{
+    int i;
+
+    unit->iso_transfer_len = unit->iso_data_packet_len*iso_packets_per_transfer;
+
+    // A JACK ringbuffer holds one byte less than it is created with.
+    unit->iso_free_rb = jack_ringbuffer_create(sizeof(struct libusb_transfer*)*(iso_transfer_count + 1));
+    unit->iso_transfer_bufs = malloc(unit->iso_transfer_len*iso_transfer_count);
+    if (unit->iso_free_rb == NULL || unit->iso_transfer_bufs == NULL)
+    {
+        return LASERSHARK_CMD_FAIL;
+    }
+
+    for (i = 0; i < iso_transfer_count; i++)
+    {
+        unit->iso_transfers[i] = libusb_alloc_transfer(iso_packets_per_transfer);
+        if (unit->iso_transfers[i] == NULL)
+        {
+            return LASERSHARK_CMD_FAIL;
+        }
+
+        libusb_fill_iso_transfer(unit->iso_transfers[i], unit->devh_data, (4 | LIBUSB_ENDPOINT_OUT),
+                                 unit->iso_transfer_bufs + i*unit->iso_transfer_len,
+                                 unit->iso_transfer_len, iso_packets_per_transfer, WriteAsyncCallback, unit, 0);
+        libusb_set_iso_packet_lengths(unit->iso_transfers[i], unit->iso_data_packet_len);
+
+        jack_ringbuffer_write(unit->iso_free_rb, (const char*)&unit->iso_transfers[i], sizeof(unit->iso_transfers[i]));
+    }
+
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+/*
+Frees the transfers that are back in the pool. Any still on the bus are left alone.
+*/
+void free_iso_transfers(struct laserjack_unit *unit)
+{
+    struct libusb_transfer *transfer;
+    int idle = 0;
+
+    if (unit->iso_free_rb == NULL)
+    {
+        free(unit->iso_transfer_bufs);
+        return;
+    }
+
+    while (jack_ringbuffer_read(unit->iso_free_rb, (char*)&transfer, sizeof(transfer)) == sizeof(transfer))
+    {
+        libusb_free_transfer(transfer);
+        idle++;
+    }
+
+    if (idle == iso_transfer_count)
+    {
+        free(unit->iso_transfer_bufs);
+    }
+    jack_ringbuffer_free(unit->iso_free_rb);
+}
+
+
+/*
+Fills all the packets of an idle ISO transfer straight from the unit's JACK ringbuffer and writes it to
+the Lasershark device.
+Returns LASERSHARK_CMD_SUCCESS on success, LASERSHARK_CMD_FAIL on failure.
+*/
+int write_lasershark_data(struct laserjack_unit *unit, struct libusb_transfer *transfer)
+{
+    int rc;
+
+    if (jack_ringbuffer_read(unit->jack_rb, (char *)transfer->buffer, unit->iso_transfer_len) !=
+            unit->iso_transfer_len)
+    {
+        log_event(LOG_FROM_USB_WORKER + unit->index, unit, LOG_RINGBUFFER_READ_FAIL, 0, 0);
+        return LASERSHARK_CMD_FAIL;
+    }
+
+    rc = libusb_submit_transfer(transfer);
+
+    if(rc != 0)
+    {
+        log_event(LOG_FROM_USB_WORKER + unit->index, unit, LOG_SUBMIT_FAIL, rc, 0);
+        return LASERSHARK_CMD_FAIL;
+    }
+
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+static void setup_conversion(struct dac_conversion *conv, uint32_t dac_min_val, uint32_t dac_max_val)
+{
+    float range = (float)(dac_max_val - dac_min_val);
+
+    conv->xy_scale = range/2;
+    conv->xy_offset = range/2 + dac_min_val;
+    conv->rgb_scale = range;
+    conv->rgb_offset = dac_min_val;
+    conv->lo = dac_min_val;
+    conv->hi = dac_max_val;
+    conv->c_threshold = (dac_max_val + dac_min_val)/2;
+}
+
+
+static inline uint16_t convert(const struct dac_conversion *conv, float val, float scale, float offset)
+{
+    val = val*scale + offset;
+    // Written so NaN ends up at conv->lo.
+    return (uint16_t)(val > conv->hi ? conv->hi : (val >= conv->lo ? val : conv->lo));
+}
+
+
+#if !defined(__SSE2__) && defined(__ARM_NEON)
+// vmaxq_f32() and vminq_f32() pass NaN through, so it is swapped for lo before clamping, as in convert().
+static inline uint32x4_t convert4_neon(const sample_t *v, float32x4_t scale, float32x4_t offset,
+                                       float32x4_t lo, float32x4_t hi)
+{
+    float32x4_t val = vaddq_f32(vmulq_f32(vld1q_f32(v), scale), offset);
+
+    val = vbslq_f32(vceqq_f32(val, val), val, lo);
+    return vcvtq_u32_f32(vminq_f32(vmaxq_f32(val, lo), hi));
+}
+#endif
+
+
+/*
+Converts nframes of JACK samples to Lasershark samples, interleaved into out. y is flipped.
+
+This function is only compatible with Lasershark V2.X modules. The format is a 16 byte (little endian) array of 4 elements
+[0] = Channel A output (lower 12 bits), LASERSHARK_C_BITMASK field(0x4000), LASERSHARK_INTL_A_BITMASK(0x8000)
+[1] = Channel B output (lower 12 bits)
+[2] = X Galvo output (lower 12 bits)
+[3] = Y Galvo output (lower 12 bits).
+
+It's pretty messy... A version command should probably be added to the protocol and a check added so this can be used
+with multiple different lasershark versions... but for now, it's good enough.
+
+*/
+static void convert_frames(const struct dac_conversion *conv, uint16_t *out, const sample_t *x, const sample_t *y,
+                           const sample_t *r, const sample_t *g, const sample_t *b, nframes_t nframes)
+{
+    nframes_t frm = 0;
+    uint16_t a;
+
+#if defined(__SSE2__)
+    const __m128 xy_scale = _mm_set1_ps(conv->xy_scale), y_scale = _mm_set1_ps(-conv->xy_scale);
+    const __m128 xy_offset = _mm_set1_ps(conv->xy_offset);
+    const __m128 rgb_scale = _mm_set1_ps(conv->rgb_scale), rgb_offset = _mm_set1_ps(conv->rgb_offset);
+    const __m128 lo = _mm_set1_ps(conv->lo), hi = _mm_set1_ps(conv->hi);
+    const __m128i c_below = _mm_set1_epi32((int)conv->c_threshold - 1);
+    const __m128i c_bit = _mm_set1_epi32(LASERSHARK_C_BITMASK);
+    const __m128i intl_a_bit = _mm_set1_epi32(LASERSHARK_INTL_A_BITMASK);
+    __m128i vx, vy, vr, vg, vb, ab, xy;
+
+    // max before min so NaN ends up at lo.
+#define CONVERT4(v, scale, offset) \
+    _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(v), scale), offset), lo), hi))
+
+    for (; frm + 4 <= nframes; frm += 4)
+    {
+        vx = CONVERT4(x + frm, xy_scale, xy_offset);
+        vy = CONVERT4(y + frm, y_scale, xy_offset);
+        vr = CONVERT4(r + frm, rgb_scale, rgb_offset);
+        vg = CONVERT4(g + frm, rgb_scale, rgb_offset);
+        vb = CONVERT4(b + frm, rgb_scale, rgb_offset);
+
+        vr = _mm_or_si128(vr, _mm_and_si128(_mm_cmpgt_epi32(vb, c_below), c_bit));
+        vr = _mm_or_si128(vr, intl_a_bit);
+
+        // Every value fits in 16 bits, so pair them up in 32 bit lanes and interleave the pairs.
+        ab = _mm_or_si128(vr, _mm_slli_epi32(vg, 16));
+        xy = _mm_or_si128(vx, _mm_slli_epi32(vy, 16));
+        _mm_storeu_si128((__m128i*)(out + frm*LASERJACK_FRAME_ELEMENTS), _mm_unpacklo_epi32(ab, xy));
+        _mm_storeu_si128((__m128i*)(out + frm*LASERJACK_FRAME_ELEMENTS + 8), _mm_unpackhi_epi32(ab, xy));
+    }
+#undef CONVERT4
+#elif defined(__ARM_NEON)
+    const float32x4_t xy_scale = vdupq_n_f32(conv->xy_scale), y_scale = vdupq_n_f32(-conv->xy_scale);
+    const float32x4_t xy_offset = vdupq_n_f32(conv->xy_offset);
+    const float32x4_t rgb_scale = vdupq_n_f32(conv->rgb_scale), rgb_offset = vdupq_n_f32(conv->rgb_offset);
+    const float32x4_t lo = vdupq_n_f32(conv->lo), hi = vdupq_n_f32(conv->hi);
+    const uint32x4_t c_threshold = vdupq_n_u32(conv->c_threshold);
+    const uint32x4_t c_bit = vdupq_n_u32(LASERSHARK_C_BITMASK);
+    const uint32x4_t intl_a_bit = vdupq_n_u32(LASERSHARK_INTL_A_BITMASK);
+    uint32x4_t vr, vb;
+    uint16x4x4_t o;
+
+#define CONVERT4(v, scale, offset) convert4_neon(v, scale, offset, lo, hi)
+
+    for (; frm + 4 <= nframes; frm += 4)
+    {
+        vr = CONVERT4(r + frm, rgb_scale, rgb_offset);
+        vb = CONVERT4(b + frm, rgb_scale, rgb_offset);
+        vr = vorrq_u32(vr, vandq_u32(vcgeq_u32(vb, c_threshold), c_bit));
+        vr = vorrq_u32(vr, intl_a_bit);
+
+        o.val[0] = vmovn_u32(vr);
+        o.val[1] = vmovn_u32(CONVERT4(g + frm, rgb_scale, rgb_offset));
+        o.val[2] = vmovn_u32(CONVERT4(x + frm, xy_scale, xy_offset));
+        o.val[3] = vmovn_u32(CONVERT4(y + frm, y_scale, xy_offset));
+        vst4_u16(out + frm*LASERJACK_FRAME_ELEMENTS, o);
+    }
+#undef CONVERT4
+#endif
+
+    for (; frm < nframes; frm++)
+    {
+        a = convert(conv, r[frm], conv->rgb_scale, conv->rgb_offset);
+        if (convert(conv, b[frm], conv->rgb_scale, conv->rgb_offset) >= conv->c_threshold) {
+            a |= LASERSHARK_C_BITMASK; // If the laser power is >= half the dac output.. turn this ttl channel on.
+        }
+        a |= LASERSHARK_INTL_A_BITMASK; // Turn on the interlock pin since this is a valid sample.
+
+        out[frm*LASERJACK_FRAME_ELEMENTS] = a;
+        out[frm*LASERJACK_FRAME_ELEMENTS + 1] = convert(conv, g[frm], conv->rgb_scale, conv->rgb_offset);
+        out[frm*LASERJACK_FRAME_ELEMENTS + 2] = convert(conv, x[frm], conv->xy_scale, conv->xy_offset);
+        out[frm*LASERJACK_FRAME_ELEMENTS + 3] = convert(conv, y[frm], -conv->xy_scale, conv->xy_offset);
+    }
+}
+
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+
+/*
+Steers the unit's queue level, in frames, back to its setpoint by correcting its resampling step.
+Called by the USB worker with a fresh device ringbuffer reading.
+*/
+static void compensate_drift(struct laserjack_unit *unit, uint32_t queued, uint64_t now)
+{
+    const double w = 1000.0/DRIFT_TIME_CONSTANT_MS;
+    const double max = DRIFT_MAX_PPM/1e6;
+    uint32_t frame_len = LASERJACK_FRAME_ELEMENTS*sizeof(uint16_t);
+    double dt, error, correction;
+
+    if (!unit->drift_start)
+    {
+        unit->drift_start = now;
+        unit->drift_last = now;
+        unit->drift_level = queued;
+        return;
+    }
+
+    dt = (now - unit->drift_last)/1000.0;
+    unit->drift_last = now;
+    unit->drift_level += (queued - unit->drift_level)*dt/(DRIFT_SMOOTH_MS/1000.0 + dt);
+
+    // The level can't be steered below where the device starts running dry, so aim a transfer above where
+    // it settled.
+    if (now - unit->drift_start < DRIFT_SETTLE_MS)
+    {
+        unit->drift_setpoint = unit->drift_level + unit->iso_transfer_len/frame_len;
+        return;
+    }
+    // Too much queued means fewer frames should be made from the same input, so a longer step.
+    error = (unit->drift_level - unit->drift_setpoint)/lasershark_ilda_rate;
+    unit->drift_integral += w*w*error*dt;
+    unit->drift_integral = unit->drift_integral > max ? max : (unit->drift_integral < -max ? -max : unit->drift_integral);
+    correction = unit->drift_integral + 2*w*error;
+    correction = correction > max ? max : (correction < -max ? -max : correction);
+
+    atomic_store_explicit(&unit->step_correction,
+                          (int_fast64_t)(correction*atomic_load_explicit(&resample_step, memory_order_relaxed)),
+                          memory_order_relaxed);
+    // A device clock running fast is made up for by a shorter step.
+    atomic_store_explicit(&unit->stat_drift_ppb, (int)(-unit->drift_integral*1e9), memory_order_relaxed);
+}
+
+
+/*
+Records how much the unit has queued and, in adaptive mode, moves its jack_rb target. Called with
+usb_worker_lock held.
+*/
+static void track_queue(struct laserjack_unit *unit, int streaming, uint64_t *last_poll, uint64_t *last_change)
+{
+    uint32_t frame_len = LASERJACK_FRAME_ELEMENTS*sizeof(uint16_t);
+    uint32_t in_flight, queued, target, empty;
+    uint64_t now = now_ms();
+    int polled = 0;
+    int underrun = 0;
+    int rc;
+
+    if (poll_device && now - *last_poll >= DEVICE_POLL_MS)
+    {
+        *last_poll = now;
+        // Completion callbacks take usb_worker_lock, and they have to keep running for this to finish.
+        pthread_mutex_unlock(&unit->usb_worker_lock);
+        rc = get_ringbuffer_empty_sample_count(unit->devh_ctl, &empty);
+        pthread_mutex_lock(&unit->usb_worker_lock);
+        if (rc == LASERSHARK_CMD_SUCCESS && empty <= unit->ringbuffer_sample_count)
+        {
+            unit->device_fill = unit->ringbuffer_sample_count - empty;
+            atomic_store_explicit(&unit->stat_device_fill, unit->device_fill, memory_order_relaxed);
+            polled = 1;
+            if (streaming && unit->device_fill == 0)
+            {
+                underrun = 1;
+                atomic_fetch_add_explicit(&unit->stat_underruns, 1, memory_order_relaxed);
+            }
+        }
+    }
+
+    in_flight = iso_transfers_in_flight(unit);
+    atomic_store_explicit(&unit->queued_beyond_rb,
+                          in_flight*unit->iso_transfer_len + unit->device_fill*frame_len, memory_order_relaxed);
+    queued = jack_ringbuffer_read_space(unit->jack_rb)/frame_len + in_flight*unit->iso_transfer_len/frame_len +
+             unit->device_fill;
+    if (queued < atomic_load_explicit(&unit->stat_queued_min, memory_order_relaxed))
+    {
+        atomic_store_explicit(&unit->stat_queued_min, queued, memory_order_relaxed);
+    }
+    if (queued > atomic_load_explicit(&unit->stat_queued_max, memory_order_relaxed))
+    {
+        atomic_store_explicit(&unit->stat_queued_max, queued, memory_order_relaxed);
+    }
+
+    if (drift_compensation && polled && streaming)
+    {
+        compensate_drift(unit, queued, now);
+    }
+
+    if (!latency_budget_ms)
+    {
+        return;
+    }
+
+    target = atomic_load(&unit->jack_rb_target);
+    if (underrun)
+    {
+        target += unit->iso_transfer_len;
+        *last_change = now;
+    }
+    else if (now - *last_change >= ADAPT_INTERVAL_MS)
+    {
+        target -= unit->iso_data_packet_len;
+        *last_change = now;
+    }
+    target = target < unit->jack_rb_floor ? unit->jack_rb_floor : target;
+    target = target > unit->jack_rb_budget ? unit->jack_rb_budget : target;
+    atomic_store(&unit->jack_rb_target, target);
+}
+
+
+/*
+Submits as many full transfers as there is data and idle transfers for, then sleeps until process() or a
+completion wakes it up again.
+*/
+static void *usb_worker(void *arg)
+{
+    struct laserjack_unit *unit = arg;
+    struct libusb_transfer *transfer;
+    uint64_t last_poll = 0;
+    uint64_t last_change = now_ms();
+    int streaming = 0;
+    int rc;
+
+    pthread_mutex_lock(&unit->usb_worker_lock);
+    while (!do_exit)
+    {
+        // Send out as many data packets as we can to the DEMIGOD LASERSHARK DEVICE.
+        // Whatever doesn't fit stays in the ringbuffer until transfers complete.
+        while (jack_ringbuffer_read_space(unit->jack_rb) >= unit->iso_transfer_len &&
+                jack_ringbuffer_read(unit->iso_free_rb, (char *)&transfer, sizeof(transfer)) == sizeof(transfer))
+        {
+            rc = write_lasershark_data(unit, transfer);
+            if (rc != LASERSHARK_CMD_SUCCESS)
+            {
+                quit_program();
+                break;
+            }
+            streaming = 1;
+        }
+
+        track_queue(unit, streaming, &last_poll, &last_change);
+
+        pthread_cond_wait(&unit->usb_worker_cond, &unit->usb_worker_lock);
+    }
+    pthread_mutex_unlock(&unit->usb_worker_lock);
+
+    return NULL;
+}
+
+
+static int start_usb_worker(struct laserjack_unit *unit)
+{
+    if (pthread_create(&unit->usb_worker_tid, NULL, usb_worker, unit))
+    {
+        return LASERSHARK_CMD_FAIL;
+    }
+    unit->usb_worker_running = 1;
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+static void stop_usb_worker(struct laserjack_unit *unit)
+{
+    if (!unit->usb_worker_running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&unit->usb_worker_lock);
+    do_exit = 1;
+    pthread_cond_signal(&unit->usb_worker_cond);
+    pthread_mutex_unlock(&unit->usb_worker_lock);
+
+    pthread_join(unit->usb_worker_tid, NULL);
+    unit->usb_worker_running = 0;
+}
+
+
+static void *usb_events(void *arg)
+{
+    struct timeval tv;
+    int rc;
+
+    while (!usb_events_stop)
+    {
+        tv.tv_sec = 0;
+        tv.tv_usec = USB_EVENTS_TIMEOUT_MS*1000;
+        rc = libusb_handle_events_timeout_completed(NULL, &tv, &usb_events_stop);
+        if (rc != 0 && rc != LIBUSB_ERROR_INTERRUPTED)
+        {
+            log_event(LOG_FROM_USB_EVENTS, NULL, LOG_HANDLE_EVENTS_FAIL, rc, 0);
+            quit_program();
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+static int start_usb_events()
+{
+    if (pthread_create(&usb_events_tid, NULL, usb_events, NULL))
+    {
+        return LASERSHARK_CMD_FAIL;
+    }
+    usb_events_running = 1;
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+static void stop_usb_events()
+{
+    if (!usb_events_running)
+    {
+        return;
+    }
+
+    usb_events_stop = 1;
+    pthread_join(usb_events_tid, NULL);
+    usb_events_running = 0;
+}
+
+
+/*
+Waits for the unit's transfers still on the bus to complete, cancelling them if they take too long, so
+they can all be freed. Nothing may submit transfers any more and the event thread must still be running.
+Returns the number that never came back.
+*/
+static int drain_iso_transfers(struct laserjack_unit *unit)
+{
+    struct timespec deadline;
+    int i;
+
+    if (!usb_events_running || unit->iso_free_rb == NULL)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&unit->usb_worker_lock);
+    unit->usb_draining = 1;
+
+    deadline_in_ms(&deadline, USB_DRAIN_TIMEOUT_MS);
+    while (iso_transfers_in_flight(unit) &&
+            pthread_cond_timedwait(&unit->usb_worker_cond, &unit->usb_worker_lock, &deadline) != ETIMEDOUT);
+
+    if (iso_transfers_in_flight(unit))
+    {
+        // Idle transfers just fail to cancel.
+        for (i = 0; i < iso_transfer_count && unit->iso_transfers[i] != NULL; i++)
+        {
+            libusb_cancel_transfer(unit->iso_transfers[i]);
+        }
+
+        deadline_in_ms(&deadline, USB_DRAIN_TIMEOUT_MS);
+        while (iso_transfers_in_flight(unit) &&
+                pthread_cond_timedwait(&unit->usb_worker_cond, &unit->usb_worker_lock, &deadline) != ETIMEDOUT);
+    }
+
+    i = iso_transfers_in_flight(unit);
+    pthread_mutex_unlock(&unit->usb_worker_lock);
+
+    return i;
+}
+
+
+/*
+Converts frames straight into the unit's ringbuffer free space, which may be split in two where it wraps.
+Returns how many frames fit.
+*/
+static nframes_t write_frames(struct laserjack_unit *unit, const sample_t *x, const sample_t *y, const sample_t *r,
+                              const sample_t *g, const sample_t *b, nframes_t nframes)
+{
+    const size_t frame_len = LASERJACK_FRAME_ELEMENTS*sizeof(uint16_t);
+    jack_ringbuffer_data_t vec[2];
+    nframes_t n0, n1;
+
+    jack_ringbuffer_get_write_vector(unit->jack_rb, vec);
+    n0 = vec[0].len/frame_len;
+    n0 = n0 < nframes ? n0 : nframes;
+    n1 = vec[1].len/frame_len;
+    n1 = n1 < nframes - n0 ? n1 : nframes - n0;
+
+    convert_frames(&unit->conv, (uint16_t *)vec[0].buf, x, y, r, g, b, n0);
+    if (n1)
+    {
+        convert_frames(&unit->conv, (uint16_t *)vec[1].buf, x + n0, y + n0, r + n0, g + n0, b + n0, n1);
+    }
+    jack_ringbuffer_write_advance(unit->jack_rb, (n0 + n1)*frame_len);
+
+    return n0 + n1;
+}
+
+
+/*
+Interpolates up to RESAMPLE_CHUNK output frames from this period's input into rs->out.
+Returns how many were made, 0 once the period is used up.
+*/
+static nframes_t resample_chunk(struct resampler *rs, sample_t * const in[5], nframes_t nframes, uint64_t step)
+{
+    nframes_t out = 0;
+    uint64_t pos;
+    uint32_t i;
+    float frac, a;
+    int c;
+
+    // Output at pos needs the input frames either side of it.
+    for (c = 0; c < 5; c++)
+    {
+        pos = rs->pos;
+        for (out = 0; out < RESAMPLE_CHUNK && (i = pos >> 32) < nframes; out++, pos += step)
+        {
+            frac = (uint32_t)pos*(1.0f/RESAMPLE_ONE);
+            a = i ? in[c][i - 1] : rs->last[c];
+            rs->out[c][out] = a + (in[c][i] - a)*frac;
+        }
+    }
+    rs->pos = pos;
+
+    return out;
+}
+
+
+static void process_unit(struct laserjack_unit *unit, nframes_t nframes, uint64_t step)
+{
+    const size_t frame_len = LASERJACK_FRAME_ELEMENTS*sizeof(uint16_t);
+    struct resampler *rs = &unit->resampler;
+    sample_t *in[5];
+    nframes_t made, written, dropped = 0;
+    size_t queued, limit;
+    nframes_t room = ~(nframes_t)0;
+    int c;
+
+    in[0] = (sample_t *) jack_port_get_buffer (unit->in_x, nframes);
+    in[1] = (sample_t *) jack_port_get_buffer (unit->in_y, nframes);
+    in[2] = (sample_t *) jack_port_get_buffer (unit->in_r, nframes);
+    in[3] = (sample_t *) jack_port_get_buffer (unit->in_g, nframes);
+    in[4] = (sample_t *) jack_port_get_buffer (unit->in_b, nframes);
+
+    // In adaptive mode, anything that would queue up past the target plus this period's output is dropped.
+    if (latency_budget_ms)
+    {
+        queued = jack_ringbuffer_read_space(unit->jack_rb) +
+                 atomic_load_explicit(&unit->queued_beyond_rb, memory_order_relaxed);
+        limit = atomic_load_explicit(&unit->jack_rb_target, memory_order_relaxed) +
+                ((((uint64_t)nframes << 32)/step) + 1)*frame_len;
+        room = queued < limit ? (limit - queued)/frame_len : 0;
+    }
+
+    // Convert all samples given to us from the GODLY JACK SERVER, resampled to the ILDA rate if it differs.
+    if (step == RESAMPLE_ONE && rs->pos == RESAMPLE_ONE)
+    {
+        written = write_frames(unit, in[0], in[1], in[2], in[3], in[4], nframes < room ? nframes : room);
+        dropped = nframes - written;
+    }
+    else
+    {
+        while ((made = resample_chunk(rs, in, nframes, step)) > 0)
+        {
+            written = write_frames(unit, rs->out[0], rs->out[1], rs->out[2], rs->out[3], rs->out[4],
+                                   made < room ? made : room);
+            room -= written;
+            dropped += made - written;
+        }
+        rs->pos -= (uint64_t)nframes << 32;
+    }
+    for (c = 0; c < 5; c++)
+    {
+        rs->last[c] = in[c][nframes - 1];
+    }
+
+    if (dropped)
+    {
+        log_event(LOG_FROM_PROCESS, unit, LOG_RINGBUFFER_FULL, dropped, 0);
+    }
+
+    // Let the USB worker send it. If it is busy it will see the data when it loops around.
+    if (pthread_mutex_trylock(&unit->usb_worker_lock) == 0)
+    {
+        pthread_cond_signal(&unit->usb_worker_cond);
+        pthread_mutex_unlock(&unit->usb_worker_lock);
+    }
+}
+
+
+static int process (nframes_t nframes, void *arg)
+{
+    uint64_t step = atomic_load_explicit(&resample_step, memory_order_relaxed);
+    int i;
+
+    for (i = 0; i < unit_count; i++)
+    {
+        process_unit(&units[i], nframes,
+                     step + atomic_load_explicit(&units[i].step_correction, memory_order_relaxed));
+    }
+
+    return 0;
+}
+
+
+static int bufsize (nframes_t nframes, void *arg)
+{
+    printf ("The maximum buffer size is now %u\n", nframes);
+    return 0;
+}
+
+
+/*
+The ILDA rate stays as it was first set, later JACK rate changes just change the resampling.
+*/
+static int srate (nframes_t nframes, void *arg)
+{
+    rate = nframes;
+
+    if (lasershark_ilda_rate == 0)
+    {
+        lasershark_ilda_rate = rate < lasershark_max_ilda_rate ? rate : lasershark_max_ilda_rate;
+        printf ("ILDA rate specified as: %u pps\n", lasershark_ilda_rate);
+    }
+
+    atomic_store_explicit(&resample_step, ((uint64_t)rate << 32)/lasershark_ilda_rate, memory_order_relaxed);
+    if (rate != lasershark_ilda_rate)
+    {
+        printf("Resampling from JACK rate %u to %u pps\n", rate, lasershark_ilda_rate);
+    }
+
+    return 0;
+}
+
+
+static void jack_shutdown (void *arg)
+{
+    printf("JACK shutting down...\n");
+    quit_program();
+}
+
+
+static void latency (jack_latency_callback_mode_t mode, void *arg)
+{
+    jack_latency_range_t range;
+    struct laserjack_unit *unit;
+    int i;
+
+    if (mode != JackPlaybackLatency)
+    {
+        return;
+    }
+
+    for (i = 0; i < unit_count; i++)
+    {
+        unit = &units[i];
+        if (unit->in_x == NULL)
+        {
+            continue;
+        }
+
+        range.min = atomic_load(&unit->port_latency_min);
+        range.max = atomic_load(&unit->port_latency_max);
+        jack_port_set_latency_range(unit->in_x, mode, &range);
+        jack_port_set_latency_range(unit->in_y, mode, &range);
+        jack_port_set_latency_range(unit->in_r, mode, &range);
+        jack_port_set_latency_range(unit->in_g, mode, &range);
+        jack_port_set_latency_range(unit->in_b, mode, &range);
+    }
+}
+
+
+static void list_lasersharks()
+{
+    int rc;
+    libusb_device **devs = NULL;
+    struct libusb_device_handle *devh = NULL;
+    struct libusb_device_descriptor desc;
+    unsigned char serial[64];
+    ssize_t count;
+    ssize_t i;
+
+    count = libusb_get_device_list(NULL, &devs);
+    if (count < 0)
+    {
+        fprintf(stderr, "Error encountered acquiring device list: %d\n", (int)count);
+        return;
+    }
+
+    printf("Connected LaserSharks:\n");
+    for (i = 0; i < count; i++)
+    {
+        rc = libusb_get_device_descriptor(devs[i], &desc);
+        if (rc < 0 || desc.idVendor != LASERSHARK_VIN || desc.idProduct != LASERSHARK_PID)
+        {
+            continue;
+        }
+
+        rc = libusb_open(devs[i], &devh);
+        if (rc < 0)
+        {
+            fprintf(stderr, "Error opening USB device\n");
+            continue;
+        }
+
+        memset(serial, 0, sizeof(serial));
+        rc = libusb_get_string_descriptor_ascii(devh, desc.iSerialNumber, serial, sizeof(serial));
+        if (rc < 0)
+        {
+            fprintf(stderr, "Error obtaining iSerialNumber: %d\n", /*libusb_error_name(rc)*/rc);
+        }
+        else
+        {
+            printf("\tiSerialNumber: %s\n", serial);
+        }
+
+        libusb_close(devh);
+    }
+
+    libusb_free_device_list(devs, 1); // Free the list and dereference all devices
+}
+
+
+/*
+Opens the control and data handles of the Lasershark with the given serial number, or of the first one
+found if serial is NULL.
+Returns LASERSHARK_CMD_SUCCESS on success, LASERSHARK_CMD_FAIL on failure.
+*/
+static int open_lasershark(struct laserjack_unit *unit, const char *serial)
+{
+    int rc;
+    libusb_device **devs = NULL;
+    struct libusb_device_descriptor desc;
+    ssize_t count;
+    ssize_t i;
+
+    count = libusb_get_device_list(NULL, &devs);
+    if (count < 0)
+    {
+        fprintf(stderr, "Error encountered acquiring device list: %d\n", (int)count);
+        return LASERSHARK_CMD_FAIL;
+    }
+
+    for (i = 0; i < count && unit->devh_data == NULL; i++)
+    {
+        rc = libusb_get_device_descriptor(devs[i], &desc);
+        if (rc < 0 || desc.idVendor != LASERSHARK_VIN || desc.idProduct != LASERSHARK_PID)
+        {
+            continue;
+        }
+
+        rc = libusb_open(devs[i], &unit->devh_ctl);
+        if (rc < 0)
+        {
+            fprintf(stderr, "Error opening USB device\n");
+            unit->devh_ctl = NULL;
+            continue;
+        }
+
+        memset(unit->serialnum, 0, sizeof(unit->serialnum));
+        rc = libusb_get_string_descriptor_ascii(unit->devh_ctl, desc.iSerialNumber, unit->serialnum,
+                                                lasershark_serialnum_len);
+        if (rc < 0)
+        {
+            fprintf(stderr, "Error obtaining iSerialNumber: %d\n", /*libusb_error_name(rc)*/rc);
+        }
+
+        if ((serial == NULL || (rc >= 0 && strcmp((const char*)unit->serialnum, serial) == 0)) &&
+                libusb_open(devs[i], &unit->devh_data) == 0)
+        {
+            break;
+        }
+
+        libusb_close(unit->devh_ctl);
+        unit->devh_ctl = NULL;
+        unit->devh_data = NULL;
+    }
+
+    libusb_free_device_list(devs, 1); // Free the list and dereference all devices
+
+    return unit->devh_data ? LASERSHARK_CMD_SUCCESS : LASERSHARK_CMD_FAIL;
+}
+
+
+/*
+Claims a unit's interfaces and reads its parameters.
+Returns LASERSHARK_CMD_SUCCESS on success, LASERSHARK_CMD_FAIL on failure.
+*/
+static int setup_unit(struct laserjack_unit *unit)
+{
+    int rc;
+    uint32_t temp;
+
+    rc = libusb_claim_interface(unit->devh_ctl, 0);
+    if (rc < 0)
+    {
+        fprintf(stderr, "Error claiming control interface: %d\n", /*libusb_error_name(rc)*/rc);
+        return LASERSHARK_CMD_FAIL;
+    }
+    unit->ctl_claimed = 1;
+    rc = libusb_claim_interface(unit->devh_data, 1);
+    if (rc < 0)
+    {
+        fprintf(stderr, "Error claiming data interface: %d\n", /*libusb_error_name(rc)*/rc);
+        return LASERSHARK_CMD_FAIL;
+    }
+    unit->data_claimed = 1;
+
+    rc = libusb_set_interface_alt_setting(unit->devh_data, 1, 0);
+    if (rc < 0)
+    {
+        fprintf(stderr, "Error setting alternative (ISO) data interface: %d\n", /*libusb_error_name(rc)*/rc);
+        return LASERSHARK_CMD_FAIL;
+    }
+
+    printf("iSerialNumber: %s\n", unit->serialnum);
+
+
+    rc = get_fw_major_version(unit->devh_ctl, &unit->fw_major_version);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        printf("Getting FW Major version failed. (Consider upgrading your firmware!)\n");
+        return LASERSHARK_CMD_FAIL;
+    }
+    printf("Getting FW Major version: %d\n", unit->fw_major_version);
+
+    rc = get_fw_minor_version(unit->devh_ctl, &unit->fw_minor_version);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        printf("Getting FW Minor version failed. (Consider upgrading your firmware!)\n");
+        return LASERSHARK_CMD_FAIL;
+    }
+    printf("Getting FW Minor version: %d\n", unit->fw_minor_version);
+
+    if (unit->fw_major_version != LASERSHARK_FW_MAJOR_VERSION ||
+            unit->fw_minor_version != LASERSHARK_FW_MINOR_VERSION) {
+        printf("Your FW is not capable of proper bulk transfers or clear commands. Consider upgrading your firmware!\n");
+    } else {
+        printf("Firmware supports ring buffer clears. Clearing now.\n");
+        rc = clear_ringbuffer(unit->devh_ctl);
+        if (rc != LASERSHARK_CMD_SUCCESS) {
+            printf("Clearing ringbuffer buffer failed.\n");
+            return LASERSHARK_CMD_FAIL;
+        }
+    }
+
+    unit->max_iso_data_len = libusb_get_max_iso_packet_size(libusb_get_device(unit->devh_data), (4 | LIBUSB_ENDPOINT_OUT));
+    printf("Max iso data packet length according to descriptors: %d\n", unit->max_iso_data_len);
+
+
+    rc = get_samp_element_count(unit->devh_ctl, &unit->samp_element_count);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        printf("Getting sample element count failed\n");
+        return LASERSHARK_CMD_FAIL;
+    }
+    printf("Getting sample element count: %d\n", unit->samp_element_count);
+    if (unit->samp_element_count != LASERJACK_FRAME_ELEMENTS)
+    {
+        printf("Unsupported sample element count\n");
+        return LASERSHARK_CMD_FAIL;
+    }
+
+
+    rc = get_iso_packet_sample_count(unit->devh_ctl, &unit->iso_packet_sample_count);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        printf("Getting iso packet sample count failed\n");
+        return LASERSHARK_CMD_FAIL;
+    }
+    printf("Getting iso packet sample count: %d\n", unit->iso_packet_sample_count);
+
+
+    rc = get_max_ilda_rate(unit->devh_ctl, &unit->max_ilda_rate);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        printf("Getting max ilda rate failed\n");
+        return LASERSHARK_CMD_FAIL;
+    }
+    printf("Getting max ilda rate: %u pps\n", unit->max_ilda_rate);
+
+
+    rc = get_dac_min(unit->devh_ctl, &unit->dac_min_val);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        printf("Getting dac min failed\n");
+        return LASERSHARK_CMD_FAIL;
+    }
+    printf("Getting dac min: %d\n", unit->dac_min_val);
+
+
+    rc = get_dac_max(unit->devh_ctl, &unit->dac_max_val);
+    if (rc != LASERSHARK_CMD_SUCCESS) {
+        printf("Getting dac max failed\n");
+        return LASERSHARK_CMD_FAIL;
+    }
+    printf("getting dac max: %d\n", unit->dac_max_val);
+    setup_conversion(&unit->conv, unit->dac_min_val, unit->dac_max_val);
+
+
+    rc = get_ringbuffer_sample_count(unit->devh_ctl, &unit->ringbuffer_sample_count);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        printf("Getting ringbuffer sample count\n");
+        return LASERSHARK_CMD_FAIL;
+    }
+    printf("Getting ringbuffer sample count: %d\n", unit->ringbuffer_sample_count);
+
+
+    rc = get_ringbuffer_empty_sample_count(unit->devh_ctl, &temp);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        printf("Getting ringbuffer empty sample count failed. (Consider upgrading your firmware)\n");
+    }
+    printf("Getting ringbuffer empty sample count: %d\n", temp);
+
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+/*
+Registers the unit's ports. A single unit keeps the plain port names, with several each group is
+prefixed with its unit's serial number.
+Returns LASERSHARK_CMD_SUCCESS on success, LASERSHARK_CMD_FAIL on failure.
+*/
+static int register_unit_ports(struct laserjack_unit *unit)
+{
+    char name[sizeof(unit->serialnum) + 8];
+    const char *prefix = unit_count > 1 ? (const char*)unit->serialnum : "";
+    const char *sep = unit_count > 1 ? "_" : "";
+
+    snprintf(name, sizeof(name), "%s%sin_x", prefix, sep);
+    unit->in_x = jack_port_register (client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+    snprintf(name, sizeof(name), "%s%sin_y", prefix, sep);
+    unit->in_y = jack_port_register (client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+    snprintf(name, sizeof(name), "%s%sin_g", prefix, sep);
+    unit->in_r = jack_port_register (client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+    snprintf(name, sizeof(name), "%s%sin_r", prefix, sep);
+    unit->in_g = jack_port_register (client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+    snprintf(name, sizeof(name), "%s%sin_b", prefix, sep);
+    unit->in_b = jack_port_register (client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+
+    if (!unit->in_x || !unit->in_y || !unit->in_r || !unit->in_g || !unit->in_b)
     {
-        printf("ISO transfer err: %d   bytes transferred: %d\n", transfer->status, transfer->actual_length);
+        return LASERSHARK_CMD_FAIL;
     }
-    free(transfer->buffer);
-    libusb_free_transfer(transfer);
+    return LASERSHARK_CMD_SUCCESS;
 }
 
 
-
 /*
-Writes an ISO packet to the Lasershark device.
+Sets the unit streaming at the ILDA rate and allocates what its USB worker needs.
 Returns LASERSHARK_CMD_SUCCESS on success, LASERSHARK_CMD_FAIL on failure.
 */
-int write_lasershark_data(unsigned char *data, int len)
+static int start_unit_output(struct laserjack_unit *unit)
 {
+    const uint32_t frame_len = LASERJACK_FRAME_ELEMENTS*sizeof(uint16_t);
     int rc;
 
-    if (len > max_iso_data_len)
+    rc = set_ilda_rate(unit->devh_ctl, lasershark_ilda_rate);
+    if (rc != LASERSHARK_CMD_SUCCESS)
     {
-        printf("Oversized iso write length. %d > %d\n", len, max_iso_data_len);
+        printf("setting ILDA rate failed\n");
         return LASERSHARK_CMD_FAIL;
     }
+    printf("Setting ILDA rate worked: %u pps\n", lasershark_ilda_rate);
 
-    struct libusb_transfer *transfer = libusb_alloc_transfer(1);
 
-    if (!transfer)
+    rc = set_output(unit->devh_ctl, LASERSHARK_CMD_OUTPUT_ENABLE);
+    if (rc != LASERSHARK_CMD_SUCCESS)
     {
-        printf("Could not allocate memory for iso transfer.\n");
-        return LIBUSB_ERROR_NO_MEM;
+        printf("Enable output failed\n");
+        return LASERSHARK_CMD_FAIL;
     }
+    printf("Enable output worked\n");
 
-    libusb_fill_iso_transfer(transfer, devh_data, (4 | LIBUSB_ENDPOINT_OUT),
-                             malloc(len), len, 1, WriteAsyncCallback, 0, 0);
 
-    if (!transfer->buffer)
+    unit->iso_data_packet_len = unit->iso_packet_sample_count * unit->samp_element_count * sizeof(uint16_t);
+    if (unit->iso_data_packet_len > unit->max_iso_data_len)
     {
-        printf("Could not create iso transfer packet.\n");
-        libusb_free_transfer(transfer);
+        printf("Oversized iso write length. %d > %d\n", unit->iso_data_packet_len, unit->max_iso_data_len);
         return LASERSHARK_CMD_FAIL;
     }
 
-    libusb_set_iso_packet_lengths(transfer, len);
-
-    memcpy(transfer->buffer, data, len);
-
-    rc = libusb_submit_transfer(transfer);
-
-    if(rc != 0)
+    rc = alloc_iso_transfers(unit);
+    if (rc != LASERSHARK_CMD_SUCCESS)
     {
-        printf("Could not submit transfer: rc=%d\n", rc);
+        printf("Could not allocate iso transfers\n");
         return LASERSHARK_CMD_FAIL;
     }
+    printf("Using %d iso transfers of %d packets\n", iso_transfer_count, iso_packets_per_transfer);
 
-    return LASERSHARK_CMD_SUCCESS;
-}
-
-
-/*
-Converts from one linear scale to another in the sexiest manner possible, with math.
-*/
-static uint16_t convert(float OldValue, float OldMin, float OldMax, uint32_t NewMax, uint32_t NewMin)
-{
-
-    uint16_t val = (uint16_t)((((OldValue - OldMin) * (float)(NewMax - NewMin)) / (OldMax - OldMin)) + (float)NewMin);
-    return val;
-}
-
-
-/*
-This function is only compatible with Lasershark V2.X modules. The format is a 16 byte (little endian) array of 4 elements
-[0] = Channel A output (lower 12 bits), LASERSHARK_C_BITMASK field(0x4000), LASERSHARK_INTL_A_BITMASK(0x8000)
-[1] = Channel B output (lower 12 bits)
-[2] = X Galvo output (lower 12 bits)
-[3] = Y Galvo output (lower 12 bits).
-
-It's pretty messy... A version command should probably be added to the protocol and a check added so this can be used
-with multiple different lasershark versions... but for now, it's good enough.
-
-*/
-static int process (nframes_t nframes, void *arg)
-{
-    uint16_t temp[4];
-    int avail, written, i, j, rc;
-    nframes_t frm;
-
-    sample_t *i_x = (sample_t *) jack_port_get_buffer (in_x, nframes);
-    sample_t *i_y = (sample_t *) jack_port_get_buffer (in_y, nframes);
-    sample_t *i_r = (sample_t *) jack_port_get_buffer (in_r, nframes);
-    sample_t *i_g = (sample_t *) jack_port_get_buffer (in_g, nframes);
-    sample_t *i_b = (sample_t *) jack_port_get_buffer (in_b, nframes);
-
-    // Read in all samples given to us from the GODLY JACK SERVER
-    for (frm = 0; frm < nframes; frm++)
-    {
-        // Read the data and convert it to a format suitable to be sent out to the lasershark.
-        temp[0] = convert(*i_r++, -0.0f, 1.0f, lasershark_dac_max_val, lasershark_dac_min_val);
-        temp[1] = convert(*i_g++, -0.0f, 1.0f, lasershark_dac_max_val, lasershark_dac_min_val);
-        if (convert(*i_b++, -0.0f, 1.0f, lasershark_dac_max_val, lasershark_dac_min_val) >= 
-		(lasershark_dac_max_val + lasershark_dac_min_val)/2) {
-		temp[0] |= LASERSHARK_C_BITMASK; // If the laser power is >= half the dac output.. turn this ttl channel on.
-	}
-	temp[0] |= LASERSHARK_INTL_A_BITMASK; // Turn on the interlock pin since this is a valid sample.
-
-        temp[2] = convert(*i_x++, -1.0f, 1.0f, lasershark_dac_max_val, lasershark_dac_min_val);
-        temp[3] = convert(*i_y++ * -1.0f, -1.0f, 1.0f, lasershark_dac_max_val, lasershark_dac_min_val);
-
-        // Jam the samples in the ringbuffer.
-        avail = jack_ringbuffer_write_space(jack_rb);
-        if (avail >= lasershark_samp_element_count*sizeof(uint16_t))
-        {
-            written = jack_ringbuffer_write(jack_rb, (const char*)temp, lasershark_samp_element_count*sizeof(uint16_t));
-            if (written != lasershark_samp_element_count*sizeof(uint16_t) )
-            {
-                printf("Ringbuffer write failure\n");
-            }
-        }
-        else
-        {
-            printf("Ringbuffer full\n");
-            break;
-        }
-    }
-
-    // Send out as many data packets as we can to the DEMIGOD LASERSHARK DEVICE
-    while ((i = jack_ringbuffer_read_space(jack_rb)) >= laserjack_iso_data_packet_len)
+    unit->jack_rb_len = unit->iso_data_packet_len * JACK_RB_PACKETS;
+    if (latency_budget_ms)
     {
-        // read from the buffer
-        j = jack_ringbuffer_read(jack_rb, (char *)laserjack_iso_data_packet_buf, laserjack_iso_data_packet_len);
-
-        if (j != laserjack_iso_data_packet_len)
+        unit->jack_rb_budget = (uint64_t)latency_budget_ms*lasershark_ilda_rate/1000*frame_len;
+        unit->jack_rb_floor = unit->iso_transfer_len;
+        if (unit->jack_rb_budget < unit->jack_rb_floor)
         {
-            printf("Ringbuffer read failure\n");
-            quit_program();
+            printf("Latency budget too small, a transfer alone takes %u ms\n",
+                   frames_to_ms(unit->iso_transfer_len/frame_len));
+            return LASERSHARK_CMD_FAIL;
         }
-
-        rc = write_lasershark_data((void *)laserjack_iso_data_packet_buf, laserjack_iso_data_packet_len);
-        if (rc != LASERSHARK_CMD_SUCCESS)
+        atomic_init(&unit->jack_rb_target, unit->jack_rb_floor);
+        // Leave room for the JACK period on top of the budget.
+        if (unit->jack_rb_len < unit->jack_rb_budget*2)
         {
-            quit_program();
+            unit->jack_rb_len = unit->jack_rb_budget*2;
         }
     }
-
-    return 0;
-}
-
-
-static int bufsize (nframes_t nframes, void *arg)
-{
-    printf ("The maximum buffer size is now %u\n", nframes);
-    return 0;
-}
-
-
-static int srate (nframes_t nframes, void *arg)
-{
-    rate = nframes;
-    if (rate > lasershark_max_ilda_rate)
+    unit->jack_rb = jack_ringbuffer_create(unit->jack_rb_len);
+    if (unit->jack_rb == NULL)
     {
-        printf("Rate (%d) is higher than lasershark supports (%d)\n", rate, lasershark_max_ilda_rate);
-        quit_program();
-        return 1;
+        printf("Could not allocate JACK ringbuffer\n");
+        return LASERSHARK_CMD_FAIL;
     }
 
-    if (lasershark_ilda_rate != 0)
+
+    // lock the buffer into memory, this is *NOT* realtime safe, do it before
+    // using the buffer!
+    rc = jack_ringbuffer_mlock(unit->jack_rb);
+    if (rc)
     {
-        printf("ILDA rate was already set.. but we were asked to set again.. unimplemented! Dying.\n");
-        quit_program();
-        return 1;
+        printf("Could not lock JACK ringbuffer memory\n");
+        return LASERSHARK_CMD_FAIL;
     }
 
-    lasershark_ilda_rate = nframes;
-    printf ("ILDA rate specified as: %u pps\n", lasershark_ilda_rate);
+    return LASERSHARK_CMD_SUCCESS;
+}
 
 
-    return 0;
+static void init_unit(struct laserjack_unit *unit, int index)
+{
+    memset(unit, 0, sizeof(*unit));
+    unit->index = index;
+    unit->resampler.pos = RESAMPLE_ONE;
+    pthread_mutex_init(&unit->usb_worker_lock, NULL);
+    pthread_cond_init(&unit->usb_worker_cond, NULL);
+    atomic_init(&unit->jack_rb_target, 0);
+    atomic_init(&unit->queued_beyond_rb, 0);
+    atomic_init(&unit->stat_transfers, 0);
+    atomic_init(&unit->stat_dropped, 0);
+    atomic_init(&unit->stat_iso_errors, 0);
+    atomic_init(&unit->stat_underruns, 0);
+    atomic_init(&unit->stat_device_fill, 0);
+    atomic_init(&unit->stat_queued_min, UINT32_MAX);
+    atomic_init(&unit->stat_queued_max, 0);
+    atomic_init(&unit->step_correction, 0);
+    atomic_init(&unit->stat_drift_ppb, 0);
+    atomic_init(&unit->port_latency_min, 0);
+    atomic_init(&unit->port_latency_max, 0);
 }
 
 
-static void jack_shutdown (void *arg)
+void print_help(const char* prog_name, FILE* stream)
 {
-    printf("JACK shutting down...\n");
-    quit_program();
+    fprintf(stream, "%s [OPTION]\n", prog_name);
+    fprintf(stream, "\t-h");
+    fprintf(stream, "\tPrint this help text\n");
+    fprintf(stream, "\t-l");
+    fprintf(stream, "\tLists all connected LaserSharks\n");
+    fprintf(stream, "\t-s <LaserShark Serial Number>\n");
+    fprintf(stream, "\t\tDrive a specific LaserShark, give it up to %d times to drive several at once\n", MAX_UNITS);
+    fprintf(stream, "\t-p <ISO packets per transfer>\n");
+    fprintf(stream, "\t\tBetween %d and %d (default: %d)\n", ISO_PACKETS_MIN, ISO_PACKETS_MAX, ISO_PACKETS_DEFAULT);
+    fprintf(stream, "\t-r <ILDA rate in pps>\n");
+    fprintf(stream, "\t\tResample JACK output to this rate (default: JACK rate, capped at the device maximum)\n");
+    fprintf(stream, "\t-L <Latency budget in ms>\n");
+    fprintf(stream, "\t\tKeep only as much queued as needed to avoid running dry, up to this much\n");
+    fprintf(stream, "\t-D");
+    fprintf(stream, "\tCompensate for drift between the JACK and LaserShark clocks by resampling, not with -L\n");
+    fprintf(stream, "\t-S <Stats file, - for stderr>\n");
+    fprintf(stream, "\t\tReport ringbuffer fill, latency, dropped samples and ISO errors once a second\n");
 }
 
 
 int main (int argc, char *argv[])
 {
     int rc;
-    uint32_t temp;
     struct sigaction sigact;
+    struct timespec quit_deadline;
+    int stuck;
+    int i;
 
     char jack_client_name[] = "lasershark";
 
+    int hflag = 0;
+    int lflag = 0;
+    int sflag = 0;
+    int pflag = 0;
+    int rflag = 0;
+    int Lflag = 0;
+    int Sflag = 0;
+    int Dflag = 0;
+    char* requested_serials[MAX_UNITS];
+    char* stats_path = NULL;
+    int c;
+
+    opterr_portable = 1;
+    while (-1 != (c =getopt_portable(argc, argv, "hls:p:r:L:S:D"))) {
+        switch(c) {
+        case 'h':
+            hflag++;
+            break;
+        case 'l':
+            lflag++;
+            break;
+        case 's':
+            if (sflag == MAX_UNITS) {
+                fprintf(stderr, "Cannot drive more than %d LaserSharks.\n", MAX_UNITS);
+                exit(1);
+            }
+            requested_serials[sflag++] = optarg_portable;
+            break;
+        case 'p':
+            pflag++;
+            iso_packets_per_transfer = atoi(optarg_portable);
+            break;
+        case 'r':
+            rflag++;
+            lasershark_ilda_rate = atoi(optarg_portable);
+            break;
+        case 'L':
+            Lflag++;
+            latency_budget_ms = atoi(optarg_portable);
+            break;
+        case 'S':
+            Sflag++;
+            stats_path = optarg_portable;
+            break;
+        case 'D':
+            Dflag++;
+            break;
+        default:
+            print_help(argv[0], stderr);
+            exit(1);
+        }
+    }
 
-    pid = getpid();
-    sigact.sa_handler = sig_hdlr;
-    sigemptyset(&sigact.sa_mask);
-    sigact.sa_flags = 0;
-    sigaction(SIGINT, &sigact, NULL);
-    sigaction(SIGUSR1, &sigact, NULL);
-
-
-    rc = libusb_init(NULL);
-    if (rc < 0)
-    {
-        fprintf(stderr, "Error initializing libusb: %d\n", /*libusb_error_name(rc)*/rc);
+    if (lflag && sflag) {
+        fprintf(stderr, "Cannot specify both -s and -l flags.\n");
+        print_help(argv[0], stderr);
         exit(1);
     }
 
-    devh_ctl = libusb_open_device_with_vid_pid(NULL, LASERSHARK_VIN, LASERSHARK_PID);
-    devh_data = libusb_open_device_with_vid_pid(NULL, LASERSHARK_VIN, LASERSHARK_PID);
-    if (!devh_ctl || !devh_data)
-    {
-        fprintf(stderr, "Error finding USB device\n");
-        goto out_post_release;
+    if (hflag > 1 || lflag > 1 || pflag > 1 || rflag > 1 || Lflag > 1 || Sflag > 1 || Dflag > 1) {
+        fprintf(stderr, "Cannot specify flags more than once.\n");
+        print_help(argv[0], stderr);
+        exit(1);
     }
 
-
-    libusb_set_debug(NULL, 3);
-
-    rc = libusb_claim_interface(devh_ctl, 0);
-    if (rc < 0)
-    {
-        fprintf(stderr, "Error claiming control interface: %d\n", /*libusb_error_name(rc)*/rc);
-        goto out_post_release;
-    }
-    rc = libusb_claim_interface(devh_data, 1);
-    if (rc < 0)
-    {
-        fprintf(stderr, "Error claiming data interface: %d\n", /*libusb_error_name(rc)*/rc);
-        libusb_release_interface(devh_ctl, 0);
-        goto out_post_release;
+    if (hflag) {
+        print_help(argv[0], stdout);
+        exit(0);
     }
 
-    rc = libusb_set_interface_alt_setting(devh_data, 1, 0);
-    if (rc < 0)
-    {
-        fprintf(stderr, "Error setting alternative (ISO) data interface: %d\n", /*libusb_error_name(rc)*/rc);
-        goto out;
+    if (iso_packets_per_transfer < ISO_PACKETS_MIN || iso_packets_per_transfer > ISO_PACKETS_MAX) {
+        fprintf(stderr, "ISO packets per transfer must be between %d and %d.\n", ISO_PACKETS_MIN, ISO_PACKETS_MAX);
+        print_help(argv[0], stderr);
+        exit(1);
     }
 
-    struct libusb_device_descriptor desc;
-
-    rc = libusb_get_device_descriptor(libusb_get_device(devh_ctl), &desc);
-    if (rc < 0) {
-        fprintf(stderr, "Error obtaining device descriptor: %d\n", /*libusb_error_name(rc)*/rc);
-    }
-    
-    memset(lasershark_serialnum, lasershark_serialnum_len, 0);
-    rc = libusb_get_string_descriptor_ascii(devh_ctl, desc.iSerialNumber, lasershark_serialnum, lasershark_serialnum_len);
-    if (rc < 0) {
-        fprintf(stderr, "Error obtaining iSerialNumber: %d\n", /*libusb_error_name(rc)*/rc);
+    if (rflag && lasershark_ilda_rate == 0) {
+        fprintf(stderr, "ILDA rate must be greater than 0 pps.\n");
+        print_help(argv[0], stderr);
+        exit(1);
     }
 
-    printf("iSerialNumber: %s\n", lasershark_serialnum);
-
-
-    rc = get_fw_major_version(devh_ctl, &lasershark_fw_major_version);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        printf("Getting FW Major version failed. (Consider upgrading your firmware!)\n");
-        goto out;
+    if (Lflag && latency_budget_ms == 0) {
+        fprintf(stderr, "Latency budget must be greater than 0 ms.\n");
+        print_help(argv[0], stderr);
+        exit(1);
     }
-    printf("Getting FW Major version: %d\n", lasershark_fw_major_version);
 
-    rc = get_fw_minor_version(devh_ctl, &lasershark_fw_minor_version);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        printf("Getting FW Minor version failed. (Consider upgrading your firmware!)\n");
-        goto out;
+    if (Lflag && Dflag) {
+        fprintf(stderr, "Cannot specify both -L and -D flags.\n");
+        print_help(argv[0], stderr);
+        exit(1);
     }
-    printf("Getting FW Minor version: %d\n", lasershark_fw_minor_version);
 
-    if (lasershark_fw_major_version != LASERSHARK_FW_MAJOR_VERSION ||
-            lasershark_fw_minor_version != LASERSHARK_FW_MINOR_VERSION) {
-        printf("Your FW is not capable of proper bulk transfers or clear commands. Consider upgrading your firmware!\n");
-    } else {
-        printf("Firmware supports ring buffer clears. Clearing now.\n");
-        rc = clear_ringbuffer(devh_ctl);
-        if (rc != LASERSHARK_CMD_SUCCESS) {
-            printf("Clearing ringbuffer buffer failed.\n");
-            goto out; 
+    drift_compensation = Dflag;
+    poll_device = Lflag || Sflag || Dflag;
+    if (Sflag) {
+        stats_file = strcmp(stats_path, "-") ? fopen(stats_path, "w") : stderr;
+        if (stats_file == NULL) {
+            fprintf(stderr, "Could not open %s: %s\n", stats_path, strerror(errno));
+            exit(1);
         }
     }
 
-    max_iso_data_len = libusb_get_max_iso_packet_size(libusb_get_device(devh_data), (4 | LIBUSB_ENDPOINT_OUT));
-    printf("Max iso data packet length according to descriptors: %d\n", max_iso_data_len);
+    sigact.sa_handler = sig_hdlr;
+    sigemptyset(&sigact.sa_mask);
+    sigact.sa_flags = 0;
+    sigaction(SIGINT, &sigact, NULL);
 
 
-    rc = get_samp_element_count(devh_ctl, &lasershark_samp_element_count);
-    if (rc != LASERSHARK_CMD_SUCCESS)
+    rc = libusb_init(NULL);
+    if (rc < 0)
     {
-        printf("Getting sample element count failed\n");
-        goto out;
+        fprintf(stderr, "Error initializing libusb: %d\n", /*libusb_error_name(rc)*/rc);
+        exit(1);
     }
-    printf("Getting sample element count: %d\n", lasershark_samp_element_count);
 
-
-    rc = get_iso_packet_sample_count(devh_ctl, &lasershark_iso_packet_sample_count);
-    if (rc != LASERSHARK_CMD_SUCCESS)
+    if (lflag)
     {
-        printf("Getting iso packet sample count failed\n");
-        goto out;
+        list_lasersharks();
+        libusb_exit(NULL);
+        exit(0);
     }
-    printf("Getting iso packet sample count: %d\n", lasershark_iso_packet_sample_count);
 
+    libusb_set_debug(NULL, 3);
 
-    rc = get_max_ilda_rate(devh_ctl, &lasershark_max_ilda_rate);
-    if (rc != LASERSHARK_CMD_SUCCESS)
+    iso_transfer_count = ISO_POOL_PACKETS/iso_packets_per_transfer;
+    for (i = 0; i < (sflag ? sflag : 1); i++)
     {
-        printf("Getting max ilda rate failed\n");
-        goto out;
-    }
-    printf("Getting max ilda rate: %u pps\n", lasershark_max_ilda_rate);
-
+        init_unit(&units[i], i);
+        unit_count++;
 
-    rc = get_dac_min(devh_ctl, &lasershark_dac_min_val);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        printf("Getting dac min failed\n");
-        goto out;
-    }
-    printf("Getting dac min: %d\n", lasershark_dac_min_val);
+        rc = open_lasershark(&units[i], sflag ? requested_serials[i] : NULL);
+        if (rc != LASERSHARK_CMD_SUCCESS)
+        {
+            if (sflag)
+            {
+                fprintf(stderr, "Error finding USB device with serial number %s\n", requested_serials[i]);
+            }
+            else
+            {
+                fprintf(stderr, "Error finding USB device\n");
+            }
+            goto out;
+        }
 
+        rc = setup_unit(&units[i]);
+        if (rc != LASERSHARK_CMD_SUCCESS)
+        {
+            goto out;
+        }
 
-    rc = get_dac_max(devh_ctl, &lasershark_dac_max_val);
-    if (rc != LASERSHARK_CMD_SUCCESS) {
-        printf("Getting dac max failed\n");
-        goto out;
+        if (i == 0 || units[i].max_ilda_rate < lasershark_max_ilda_rate)
+        {
+            lasershark_max_ilda_rate = units[i].max_ilda_rate;
+        }
     }
-    printf("getting dac max: %d\n", lasershark_dac_max_val);
 
-
-    rc = get_ringbuffer_sample_count(devh_ctl, &lasershark_ringbuffer_sample_count);
-    if (rc != LASERSHARK_CMD_SUCCESS)
+    if (lasershark_ilda_rate > lasershark_max_ilda_rate)
     {
-        printf("Getting ringbuffer sample count\n");
+        printf("Rate (%d) is higher than lasershark supports (%d)\n", lasershark_ilda_rate, lasershark_max_ilda_rate);
         goto out;
     }
-    printf("Getting ringbuffer sample count: %d\n", lasershark_ringbuffer_sample_count);
-
-
-    rc = get_ringbuffer_empty_sample_count(devh_ctl, &temp);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        printf("Getting ringbuffer empty sample count failed. (Consider upgrading your firmware)\n");
-    }
-    printf("Getting ringbuffer empty sample count: %d\n", temp);
 
 
     jack_status_t jack_status;
@@ -482,13 +1945,18 @@ int main (int argc, char *argv[])
     jack_set_process_callback (client, process, 0);
     jack_set_buffer_size_callback (client, bufsize, 0);
     jack_set_sample_rate_callback (client, srate, 0);
+    jack_set_latency_callback (client, latency, 0);
     jack_on_shutdown (client, jack_shutdown, 0);
 
-    in_x = jack_port_register (client, "in_x", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
-    in_y = jack_port_register (client, "in_y", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
-    in_r = jack_port_register (client, "in_g", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
-    in_g = jack_port_register (client, "in_r", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
-    in_b = jack_port_register (client, "in_b", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+    for (i = 0; i < unit_count; i++)
+    {
+        rc = register_unit_ports(&units[i]);
+        if (rc != LASERSHARK_CMD_SUCCESS)
+        {
+            printf("Could not register JACK ports\n");
+            goto out;
+        }
+    }
 
     if (lasershark_ilda_rate == 0)
     {
@@ -496,48 +1964,37 @@ int main (int argc, char *argv[])
         goto out;
     }
 
-    rc = set_ilda_rate(devh_ctl, lasershark_ilda_rate);
-    if (rc != LASERSHARK_CMD_SUCCESS)
+    for (i = 0; i < unit_count; i++)
     {
-        printf("setting ILDA rate failed\n");
-        goto out;
+        rc = start_unit_output(&units[i]);
+        if (rc != LASERSHARK_CMD_SUCCESS)
+        {
+            goto out;
+        }
     }
-    printf("Setting ILDA rate worked: %u pps\n", lasershark_ilda_rate);
 
-
-    rc = set_output(devh_ctl, LASERSHARK_CMD_OUTPUT_ENABLE);
+    rc = start_log_thread();
     if (rc != LASERSHARK_CMD_SUCCESS)
     {
-        printf("Enable output failed\n");
-        goto out;
-    }
-    printf("Enable output worked\n");
-
-
-    laserjack_iso_data_packet_len = lasershark_iso_packet_sample_count * lasershark_samp_element_count * sizeof(uint16_t);
-    laserjack_iso_data_packet_buf = malloc(laserjack_iso_data_packet_len);
-    if (laserjack_iso_data_packet_buf == NULL)
-    {
-        printf("Could not allocate laserjack iso data packet buffer\n");
+        printf("Could not start log thread\n");
         goto out;
     }
 
-    jack_rb_len = laserjack_iso_data_packet_len * JACK_RB_PACKETS;
-    jack_rb = jack_ringbuffer_create(jack_rb_len);
-    if (jack_rb == NULL)
+    rc = start_usb_events();
+    if (rc != LASERSHARK_CMD_SUCCESS)
     {
-        printf("Could not allocate JACK ringbuffer\n");
+        printf("Could not start USB event thread\n");
         goto out;
     }
 
-
-    // lock the buffer into memory, this is *NOT* realtime safe, do it before
-    // using the buffer!
-    rc = jack_ringbuffer_mlock(jack_rb);
-    if (rc)
+    for (i = 0; i < unit_count; i++)
     {
-        printf("Could not lock JACK ringbuffer memory\n");
-        goto out;
+        rc = start_usb_worker(&units[i]);
+        if (rc != LASERSHARK_CMD_SUCCESS)
+        {
+            printf("Could not start USB worker thread\n");
+            goto out;
+        }
     }
 
     if (jack_activate (client))
@@ -547,52 +2004,79 @@ int main (int argc, char *argv[])
     }
 
 
-    sigemptyset (&mask);
-    sigaddset (&mask, SIGUSR1);
-
-    sigprocmask (SIG_BLOCK, &mask, &oldmask);
-
-
     printf("Running\n");
-    do
+    pthread_mutex_lock(&quit_lock);
+    while (!do_exit)
     {
-	libusb_handle_events(0); // Quick hack.. this should be made better later.
-        //sigsuspend (&oldmask);
-        //printf("Looping... (Must have recieved a signal, don't panic).\n");
+        deadline_in_ms(&quit_deadline, QUIT_POLL_MS);
+        pthread_cond_timedwait(&quit_cond, &quit_lock, &quit_deadline);
     }
-    while (!do_exit);
-    //sigprocmask (SIG_UNBLOCK, &mask, NULL);
+    pthread_mutex_unlock(&quit_lock);
 
 
     printf("Quitting gracefully\n");
 
 // THINGS COME HERE TO DIE!!!!!!!!!!!!!!!!!!!
 out:
-    libusb_release_interface(devh_ctl, 0);
-    libusb_release_interface(devh_data, 0);
+    // process() and the USB workers must be stopped before the buffers they use go away.
+    pthread_mutex_lock(&client_lock);
+    if (client)
+    {
+        jack_client_close(client);
+        client = NULL;
+    }
+    pthread_mutex_unlock(&client_lock);
+    for (i = 0; i < unit_count; i++)
+    {
+        stop_usb_worker(&units[i]);
+    }
 
-out_post_release:
-    if (devh_ctl)
+    for (i = 0; i < unit_count; i++)
     {
-        libusb_close(devh_ctl);
+        stuck = drain_iso_transfers(&units[i]);
+        if (stuck)
+        {
+            printf("%d iso transfers never completed\n", stuck);
+        }
     }
-    if (devh_data)
+    stop_usb_events();
+
+    for (i = 0; i < unit_count; i++)
     {
-        libusb_close(devh_data);
+        if (units[i].ctl_claimed)
+        {
+            libusb_release_interface(units[i].devh_ctl, 0);
+        }
+        if (units[i].data_claimed)
+        {
+            libusb_release_interface(units[i].devh_data, 1);
+        }
+        if (units[i].devh_ctl)
+        {
+            libusb_close(units[i].devh_ctl);
+        }
+        if (units[i].devh_data)
+        {
+            libusb_close(units[i].devh_data);
+        }
     }
     libusb_exit(NULL);
-
-    if (jack_rb != NULL)
+    stop_log_thread();
+    if (stats_file != NULL && stats_file != stderr)
     {
-        jack_ringbuffer_free(jack_rb);
+        fclose(stats_file);
     }
 
-    if (laserjack_iso_data_packet_buf != NULL)
+    for (i = 0; i < unit_count; i++)
     {
-        free(laserjack_iso_data_packet_buf);
+        if (units[i].jack_rb != NULL)
+        {
+            jack_ringbuffer_free(units[i].jack_rb);
+        }
+
+        free_iso_transfers(&units[i]);
     }
 
 
     return rc;
 }
-
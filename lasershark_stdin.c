@@ -23,21 +23,27 @@ along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 #include <errno.h>
 #ifndef _WIN32
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <libusb.h>
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
 #else
 #include <signal.h>
 #endif
 #include <time.h>
 #include "lasersharklib/lasershark_lib.h"
-#include "getline_portable.h"
 #include "getopt_portable.h"
 
 
@@ -47,7 +53,44 @@ along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 // Bulk timeout in ms
 #define BULK_TIMEOUT 100
 
-int do_exit = 0;
+// Number of bulk transfers in the pool. One is being filled while the rest can be on the bus.
+#define BULK_TRANSFER_COUNT 4
+
+// How often (ms) the ringbuffer model is corrected with a reading from the Lasershark.
+#define PACE_RESYNC_MS 50
+
+// Flush sleeps for the expected drain time (at most FLUSH_MAX_SLEEP_MS at once), then polls
+// the ringbuffer every FLUSH_POLL_MS until it is empty.
+#define FLUSH_MAX_SLEEP_MS 100
+#define FLUSH_POLL_MS 2
+
+// Input is read in chunks of INPUT_CHUNK_SIZE bytes and handed from the reader thread to the
+// parser thread. Parsed samples travel to the USB thread in PACKET_COUNT sample packets.
+// Both counts must be powers of two.
+#define INPUT_CHUNK_SIZE (64*1024)
+#define INPUT_CHUNK_COUNT 8
+#define PACKET_COUNT 64
+
+// A stage waiting on an empty or full queue sleeps from QUEUE_WAIT_MIN_US doubling up to QUEUE_WAIT_MAX_US.
+#define QUEUE_WAIT_MIN_US 50
+#define QUEUE_WAIT_MAX_US 2000
+
+// With -S, throughput and ringbuffer health are reported this often.
+#define STATS_INTERVAL_MS 1000
+
+// The SWAR sample parser loads 8 bytes at a time, so input buffers carry this much slack past the
+// end of the last line.
+#define LINE_PAD 8
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SWAR_PARSE 1
+#endif
+
+// Binary input (-b) is a stream of raw struct lasershark_sample records (8 bytes, little endian).
+// A record with a non-zero pad field is an escape record. For BINARY_ESCAPE_CMD the b field holds
+// the length of a text command (e.g. "r=20000\n") that immediately follows and is fed to process_line.
+#define BINARY_ESCAPE_CMD 1
+
+volatile sig_atomic_t do_exit = 0;
 
 
 int lasershark_serialnum_len = 64;
@@ -71,6 +114,24 @@ struct libusb_device_handle *ls_devh = NULL;
 
 uint64_t line_number = 0;
 
+bool binary_input = false;
+int input_fd = -1;
+char *input_map = NULL; // Input file mapped with -f
+size_t input_map_len = 0;
+bool ilda_rate_seen = false;
+
+// Text lines that straddle input chunks are assembled here.
+char *line_carry = NULL;
+size_t line_carry_len = 0;
+size_t line_carry_size = 0;
+
+// Binary mode state carried between input chunks.
+uint8_t binary_rec[8];
+size_t binary_rec_len = 0;
+char *binary_cmd = NULL;
+size_t binary_cmd_len = 0;
+size_t binary_cmd_have = 0;
+
 
 struct lasershark_sample
 {
@@ -85,6 +146,102 @@ struct lasershark_sample
 uint32_t current_sample_entry = 0;
 
 
+// Single producer/single consumer ring of pointers, size must be a power of two.
+struct spsc_queue
+{
+    void **items;
+    uint32_t size;
+    atomic_uint head; // Only advanced by the consumer
+    atomic_uint tail; // Only advanced by the producer
+};
+
+struct input_chunk
+{
+    char *buf; // Owned buffer, INPUT_CHUNK_SIZE + LINE_PAD bytes
+    char *data; // buf, or a slice of the mapped input file
+    size_t len; // 0 marks the end of the input
+};
+
+enum packet_type
+{
+    PACKET_SAMPLES,
+    PACKET_COMMAND,
+    PACKET_FRAME,
+    PACKET_END
+};
+
+// A frame recorded between "b=1" and "l=<loops>". The samples are followed by the start of the frame
+// again, so a full packet can be sent from any position without copying across the wrap.
+struct frame
+{
+    struct lasershark_sample *samples;
+    uint32_t count;
+    uint32_t size;
+};
+
+struct sample_packet
+{
+    enum packet_type type;
+    struct lasershark_sample *samples;
+    uint32_t count;
+    char *cmd; // NUL terminated command line for PACKET_COMMAND
+    size_t cmd_len;
+    size_t cmd_size;
+    struct frame *frame; // Frame to replay for PACKET_FRAME
+    uint32_t loops; // Times to replay it, 0 until new input arrives
+    uint64_t line_number;
+};
+
+struct input_chunk input_chunks[INPUT_CHUNK_COUNT];
+struct sample_packet packets[PACKET_COUNT];
+struct sample_packet end_packet = { PACKET_END };
+
+struct spsc_queue input_queue; // reader -> parser, filled chunks
+struct spsc_queue input_free_queue; // parser -> reader, spent chunks
+struct spsc_queue packet_queue; // parser -> USB, samples and commands in input order
+struct spsc_queue packet_free_queue; // USB -> parser, spent packets
+
+struct sample_packet *cur_packet = NULL; // Packet the parser is filling, samples points into it
+struct frame *rec_frame = NULL; // Frame the parser is recording, samples points into it instead
+struct frame *replay_frame = NULL; // Last frame the USB thread replayed, its transfers may be in flight
+
+pthread_t reader_tid, parser_tid, usb_tid;
+atomic_int pipeline_stop; // Tells the reader and parser to give up
+atomic_int reader_done;
+bool parser_ok = false;
+bool usb_ok = false;
+
+struct libusb_transfer *bulk_transfers[BULK_TRANSFER_COUNT];
+struct sample_packet *bulk_packets[BULK_TRANSFER_COUNT];
+bool bulk_busy[BULK_TRANSFER_COUNT];
+int bulk_free[BULK_TRANSFER_COUNT]; // Stack of idle transfer indices
+int bulk_free_count = 0;
+int bulk_status = LIBUSB_TRANSFER_COMPLETED; // First failure reported by a completion
+
+// Model of how many samples sit in the Lasershark's ringbuffer or on the bus. Bulk writes are
+// held back until they fit under pace_target_samples.
+uint32_t target_latency_ms = 0; // 0 lets the whole ringbuffer fill
+uint32_t pace_target_samples = 0;
+double pace_fill = 0;
+uint64_t pace_last_us = 0;
+uint64_t pace_sync_us = 0;
+
+// Counters for -S. Each is only advanced by one thread and read by the stats thread, deltas are
+// taken modulo 2^32.
+FILE *stats_file = NULL;
+pthread_t stats_tid;
+atomic_int stats_stop;
+atomic_uint stat_lines; // Parser, lines or binary records parsed
+atomic_uint stat_bytes_in; // Reader
+atomic_uint stat_samples; // USB, samples the Lasershark accepted
+atomic_uint stat_bytes_out;
+atomic_uint stat_transfers;
+atomic_uint stat_stalls; // USB, times every transfer was in flight and a send had to wait
+atomic_uint stat_underruns; // USB, times the ringbuffer was found empty while streaming
+atomic_uint stat_ring_fill; // USB, samples in the ringbuffer at the last reading
+bool ring_drained = true; // Ringbuffer is empty on purpose (start, flush), not an underrun
+
+
 #ifdef _WIN32
 // Handler function will be called on separate thread!
 static BOOL WINAPI console_ctrl_handler(DWORD dwCtrlType)
@@ -128,225 +285,1466 @@ static void sig_hdlr(int signum)
         printf("what\n");
     }
 }
-#endif
+#endif
+
+static uint64_t now_us()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart*1000000.0/freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+#endif
+}
+
+
+static void sleep_us(unsigned int us)
+{
+#ifdef _WIN32
+    Sleep((us + 999)/1000);
+#else
+    struct timespec ts = {us/1000000, (us%1000000)*1000};
+    nanosleep(&ts, NULL);
+#endif
+}
+
+
+static bool queue_init(struct spsc_queue *q, uint32_t size)
+{
+    q->items = malloc(sizeof(void*)*size);
+    q->size = size;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return q->items != NULL;
+}
+
+
+static bool queue_push(struct spsc_queue *q, void *item)
+{
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&q->head, memory_order_acquire) == q->size) {
+        return false;
+    }
+    q->items[tail & (q->size - 1)] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+
+static void *queue_pop(struct spsc_queue *q)
+{
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    void *item;
+
+    if (head == atomic_load_explicit(&q->tail, memory_order_acquire)) {
+        return NULL;
+    }
+    item = q->items[head & (q->size - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return item;
+}
+
+
+static void *queue_peek(struct spsc_queue *q)
+{
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(&q->tail, memory_order_acquire)) {
+        return NULL;
+    }
+    return q->items[head & (q->size - 1)];
+}
+
+
+static bool input_running()
+{
+    return !do_exit && !atomic_load(&pipeline_stop);
+}
+
+
+static void queue_backoff(unsigned int *wait_us)
+{
+    sleep_us(*wait_us);
+    if (*wait_us < QUEUE_WAIT_MAX_US) {
+        *wait_us *= 2;
+    }
+}
+
+
+// Blocking push/pop for the reader and parser. They give up once the pipeline is stopping.
+static bool queue_push_wait(struct spsc_queue *q, void *item)
+{
+    unsigned int wait_us = QUEUE_WAIT_MIN_US;
+
+    while (!queue_push(q, item)) {
+        if (!input_running()) {
+            return false;
+        }
+        queue_backoff(&wait_us);
+    }
+    return true;
+}
+
+
+static void *queue_pop_wait(struct spsc_queue *q)
+{
+    unsigned int wait_us = QUEUE_WAIT_MIN_US;
+    void *item;
+
+    while ((item = queue_pop(q)) == NULL) {
+        if (!input_running()) {
+            return NULL;
+        }
+        queue_backoff(&wait_us);
+    }
+    return item;
+}
+
+
+static void LIBUSB_CALL bulk_transfer_cb(struct libusb_transfer *transfer)
+{
+    int idx = (int)(intptr_t)transfer->user_data;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED &&
+            bulk_status == LIBUSB_TRANSFER_COMPLETED) {
+        bulk_status = transfer->status;
+    }
+
+    atomic_fetch_add_explicit(&stat_transfers, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_bytes_out, transfer->actual_length, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_samples, transfer->actual_length/sizeof(struct lasershark_sample),
+                              memory_order_relaxed);
+
+    // Completions run on the USB thread, the only producer of packet_free_queue. Frame replays
+    // have no packet to return.
+    if (bulk_packets[idx]) {
+        queue_push(&packet_free_queue, bulk_packets[idx]);
+        bulk_packets[idx] = NULL;
+    }
+    bulk_busy[idx] = false;
+    bulk_free[bulk_free_count++] = idx;
+}
+
+
+static bool alloc_bulk_transfers()
+{
+    int i;
+
+    for (i = 0; i < BULK_TRANSFER_COUNT; i++) {
+        bulk_transfers[i] = libusb_alloc_transfer(0);
+        if (bulk_transfers[i] == NULL) {
+            return false;
+        }
+
+        // No timeout, a transfer simply stays queued while the Lasershark's ringbuffer is full.
+        // The buffer is the sample packet being sent, filled in at submission.
+        libusb_fill_bulk_transfer(bulk_transfers[i], ls_devh, (3 | LIBUSB_ENDPOINT_OUT),
+                                  NULL, 0, bulk_transfer_cb, (void*)(intptr_t)i, 0);
+        bulk_busy[i] = false;
+        bulk_free[bulk_free_count++] = i;
+    }
+
+    return true;
+}
+
+
+static void free_bulk_transfers()
+{
+    int i;
+
+    for (i = 0; i < BULK_TRANSFER_COUNT; i++) {
+        if (bulk_transfers[i]) {
+            libusb_free_transfer(bulk_transfers[i]);
+            bulk_transfers[i] = NULL;
+        }
+    }
+}
+
+
+static bool handle_bulk_events(unsigned int timeout_us)
+{
+    struct timeval tv = {timeout_us/1000000, timeout_us%1000000};
+    int r;
+
+    r = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+    if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+        fprintf(stderr, "Error handling USB events: %s\n", libusb_error_name(r));
+        return false;
+    }
+
+    if (bulk_status != LIBUSB_TRANSFER_COMPLETED) {
+        fprintf(stderr, "Error sending sample packet: transfer status %d\n", bulk_status);
+        return false;
+    }
+
+    return true;
+}
+
+
+// Waits for every submitted transfer to complete. Outstanding transfers are cancelled when quitting.
+static bool wait_for_bulk_transfers()
+{
+    bool cancelled = false;
+    int i;
+
+    while (bulk_free_count < BULK_TRANSFER_COUNT) {
+        if (do_exit && !cancelled) {
+            for (i = 0; i < BULK_TRANSFER_COUNT; i++) {
+                if (bulk_busy[i]) {
+                    libusb_cancel_transfer(bulk_transfers[i]);
+                }
+            }
+            cancelled = true;
+        }
+        if (!handle_bulk_events(BULK_TIMEOUT*1000)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+static void set_pace_target()
+{
+    uint64_t target = lasershark_ringbuffer_sample_count;
+
+    if (target_latency_ms) {
+        target = (uint64_t)target_latency_ms*lasershark_ilda_rate/1000;
+    }
+    if (target < lasershark_bulk_packet_sample_count) {
+        target = lasershark_bulk_packet_sample_count;
+    }
+    if (target > lasershark_ringbuffer_sample_count) {
+        target = lasershark_ringbuffer_sample_count;
+    }
+    pace_target_samples = target;
+}
+
+
+// Drains the model at the ILDA rate and periodically replaces it with the device's own count.
+static bool update_pace_model()
+{
+    uint64_t now = now_us();
+    uint32_t empty_samples;
+    int rc, i;
+
+    if (pace_last_us) {
+        pace_fill -= (double)(now - pace_last_us)*lasershark_ilda_rate/1000000;
+        if (pace_fill < 0) {
+            pace_fill = 0;
+        }
+    }
+    pace_last_us = now;
+
+    if (now - pace_sync_us >= PACE_RESYNC_MS*1000) {
+        rc = get_ringbuffer_empty_sample_count(ls_devh, &empty_samples);
+        if (rc != LASERSHARK_CMD_SUCCESS) {
+            fprintf(stderr, "Getting ringbuffer empty sample count failed.\n");
+            return false;
+        }
+        pace_fill = lasershark_ringbuffer_sample_count - empty_samples;
+        atomic_store_explicit(&stat_ring_fill, pace_fill, memory_order_relaxed);
+
+        // The Lasershark ran dry while there was more to send.
+        if (empty_samples == lasershark_ringbuffer_sample_count) {
+            if (!ring_drained) {
+                atomic_fetch_add_explicit(&stat_underruns, 1, memory_order_relaxed);
+                ring_drained = true;
+            }
+        } else {
+            ring_drained = false;
+        }
+
+        for (i = 0; i < BULK_TRANSFER_COUNT; i++) {
+            if (bulk_busy[i]) {
+                pace_fill += bulk_transfers[i]->length/sizeof(struct lasershark_sample);
+            }
+        }
+        pace_sync_us = now;
+    }
+
+    return true;
+}
+
+
+// Holds a write back until the model says it fits under the target fill level.
+static bool pace_samples(unsigned int sample_count)
+{
+    double excess;
+    unsigned int wait_us;
+
+    while (!do_exit) {
+        if (!update_pace_model()) {
+            return false;
+        }
+
+        excess = pace_fill + sample_count - pace_target_samples;
+        if (excess <= 0) {
+            break;
+        }
+
+        wait_us = PACE_RESYNC_MS*1000;
+        if (lasershark_ilda_rate && excess*1000000/lasershark_ilda_rate < wait_us) {
+            wait_us = excess*1000000/lasershark_ilda_rate + 1;
+        }
+        if (!handle_bulk_events(wait_us)) {
+            return false;
+        }
+    }
+
+    pace_fill += sample_count;
+    return true;
+}
+
+
+// Queues samples on the bus. If they belong to pkt, it goes back to the parser from the completion callback.
+static bool submit_samples(struct lasershark_sample *buf, uint32_t count, struct sample_packet *pkt)
+{
+    struct libusb_transfer *transfer;
+    int r, idx;
+
+    if (bulk_status != LIBUSB_TRANSFER_COMPLETED) {
+        fprintf(stderr, "Error sending sample packet: transfer status %d\n", bulk_status);
+        return false;
+    }
+
+    if (!pace_samples(count)) {
+        return false;
+    }
+
+    if (bulk_free_count == 0) {
+        atomic_fetch_add_explicit(&stat_stalls, 1, memory_order_relaxed);
+    }
+    while (bulk_free_count == 0) {
+        if (do_exit) {
+            return true;
+        }
+        if (!handle_bulk_events(BULK_TIMEOUT*1000)) {
+            return false;
+        }
+    }
+
+    idx = bulk_free[--bulk_free_count];
+    transfer = bulk_transfers[idx];
+    transfer->buffer = (unsigned char*)buf;
+    transfer->length = sizeof(struct lasershark_sample)*count;
+    bulk_packets[idx] = pkt;
+
+    r = libusb_submit_transfer(transfer);
+    if (r < 0) {
+        fprintf(stderr, "Error sending sample packet: %s\n", libusb_error_name(r));
+        bulk_packets[idx] = NULL;
+        bulk_free[bulk_free_count++] = idx;
+        if (pkt) {
+            queue_push(&packet_free_queue, pkt);
+        }
+        return false;
+    }
+    bulk_busy[idx] = true;
+
+    return true;
+}
+
+
+static bool send_samples(struct sample_packet *pkt)
+{
+    return submit_samples(pkt->samples, pkt->count, pkt);
+}
+
+
+// New input ends an open ended replay. The end of the input does not, the frame then stays up
+// until the program is told to quit.
+static bool replay_interrupted()
+{
+    void *pkt = queue_peek(&packet_queue);
+
+    return pkt != NULL && pkt != &end_packet;
+}
+
+
+// Sends a recorded frame pkt->loops times, or until new input arrives, straight from its samples.
+static bool replay_samples(struct sample_packet *pkt)
+{
+    struct frame *frame = pkt->frame;
+    uint64_t remaining = (uint64_t)pkt->loops*frame->count;
+    uint32_t pos = 0, n;
+
+    // The previous frame can only go once nothing on the bus points into it.
+    if (replay_frame) {
+        if (!wait_for_bulk_transfers()) {
+            return false;
+        }
+        free(replay_frame->samples);
+        free(replay_frame);
+    }
+    replay_frame = frame;
+    pkt->frame = NULL;
+
+    while (!do_exit) {
+        n = lasershark_bulk_packet_sample_count;
+        if (pkt->loops) {
+            if (remaining == 0) {
+                break;
+            }
+            if (n > remaining) {
+                n = remaining;
+            }
+            remaining -= n;
+        } else if (replay_interrupted()) {
+            // Finish the pass that is under way so the frame is not cut short.
+            if (pos == 0) {
+                break;
+            }
+            if (n > frame->count - pos) {
+                n = frame->count - pos;
+            }
+        }
+
+        if (!submit_samples(frame->samples + pos, n, NULL)) {
+            return false;
+        }
+        pos = (pos + n) % frame->count;
+    }
+
+    return true;
+}
+
+
+// Picks up an empty packet for the parser to fill.
+static bool next_packet()
+{
+    cur_packet = queue_pop_wait(&packet_free_queue);
+    if (cur_packet == NULL) {
+        return false;
+    }
+
+    samples = cur_packet->samples;
+    current_sample_entry = 0;
+    return true;
+}
+
+
+// Makes room in the frame being recorded for another packet worth of samples.
+static bool grow_frame()
+{
+    struct lasershark_sample *buf;
+    uint32_t size;
+
+    rec_frame->count += current_sample_entry;
+    current_sample_entry = 0;
+
+    // Leave room for the packet that repeats the start of the frame after it.
+    if (rec_frame->count + 2*lasershark_bulk_packet_sample_count > rec_frame->size) {
+        size = rec_frame->size ? rec_frame->size*2 : 16*lasershark_bulk_packet_sample_count;
+        buf = realloc(rec_frame->samples, sizeof(struct lasershark_sample)*size);
+        if (buf == NULL) {
+            fprintf(stderr, "Frame buffer realloc failed\n");
+            return false;
+        }
+        rec_frame->samples = buf;
+        rec_frame->size = size;
+    }
+
+    samples = rec_frame->samples + rec_frame->count;
+    return true;
+}
+
+
+// Hands the samples parsed so far to the USB thread.
+static bool push_samples()
+{
+    if (rec_frame) {
+        return grow_frame();
+    }
+
+    cur_packet->type = PACKET_SAMPLES;
+    cur_packet->count = current_sample_entry;
+    if (!queue_push_wait(&packet_queue, cur_packet)) {
+        return false;
+    }
+
+    return next_packet();
+}
+
+
+// Control commands run on the USB thread, in order with the samples around them.
+static bool push_command(char* line, size_t len)
+{
+    struct sample_packet *pkt;
+    char *cmd;
+
+    pkt = queue_pop_wait(&packet_free_queue);
+    if (pkt == NULL) {
+        return false;
+    }
+
+    if (pkt->cmd_size < len + 1) {
+        cmd = realloc(pkt->cmd, len + 1);
+        if (cmd == NULL) {
+            fprintf(stderr, "Command buffer realloc failed\n");
+            queue_push(&packet_free_queue, pkt);
+            return false;
+        }
+        pkt->cmd = cmd;
+        pkt->cmd_size = len + 1;
+    }
+
+    memcpy(pkt->cmd, line, len);
+    pkt->cmd[len] = '\0';
+    pkt->cmd_len = len;
+    pkt->line_number = line_number;
+    pkt->type = PACKET_COMMAND;
+
+    return queue_push_wait(&packet_queue, pkt);
+}
+
+
+#ifdef SWAR_PARSE
+// Decodes the run of up to four digits at line[*pos] with one 8 byte load. Returns false when the
+// field is empty, longer than four digits or runs past len, in which case the scalar parser decides.
+static bool inline swar_parse_integer(const char* line, size_t len, unsigned int *pos, unsigned int *val)
+{
+    uint64_t v, digits, nondigit;
+    uint32_t d;
+    unsigned int n;
+
+    memcpy(&v, line + *pos, sizeof(v));
+
+    // A byte is a digit when (b - '0') < 10. Borrows and carries only spill into bytes after the
+    // first non-digit, which are ignored.
+    digits = v - 0x3030303030303030ULL;
+    nondigit = (digits | (digits + 0x7676767676767676ULL)) & 0x8080808080808080ULL;
+    if (nondigit == 0) {
+        return false;
+    }
+
+    n = __builtin_ctzll(nondigit)/8;
+    if (n == 0 || n > 4 || *pos + n > len) {
+        return false;
+    }
+
+    // Right align the digits in four bytes, then combine pairs and the two halves.
+    d = (uint32_t)((digits & ((1ULL << (8*n)) - 1)) << (8*(4 - n)));
+    d = (d & 0x000F000F)*10 + ((d >> 8) & 0x000F000F);
+    *val = (d & 0xFFFF)*100 + (d >> 16);
+    *pos += n;
+
+    return *val <= lasershark_dac_max_val;
+}
+
+
+// Fast path for well formed sample lines. Anything it does not accept goes through the scalar
+// parser, which makes the final call and reports errors.
+static bool inline swar_parse_sample(const char* line, size_t len, unsigned int *x, unsigned int *y,
+                                     unsigned int *a, unsigned int *b, unsigned int *c, unsigned int *intl_a)
+{
+    unsigned int pos = 2;
+
+    return len >= 14 && line[0] == 's' && line[1] == '=' &&
+           swar_parse_integer(line, len, &pos, x) && pos < len && line[pos] == ',' && ++pos &&
+           swar_parse_integer(line, len, &pos, y) && pos < len && line[pos] == ',' && ++pos &&
+           swar_parse_integer(line, len, &pos, a) && pos < len && line[pos] == ',' && ++pos &&
+           swar_parse_integer(line, len, &pos, b) && pos + 2 < len && line[pos] == ',' &&
+           (*c = line[pos + 1] - '0') <= 1 && line[pos + 2] == ',' &&
+           pos + 3 < len && (*intl_a = line[pos + 3] - '0') <= 1;
+}
+#endif
+
+
+// Parses the number of a "<cmd>=<number>" frame command. The line is not NUL-terminated, so only len
+// bytes of it are looked at.
+static bool parse_frame_integer(char* line, size_t len, char cmd, uint32_t *val)
+{
+    size_t pos = 2;
+    uint64_t v = 0;
+
+    if (len < 3 || line[0] != cmd || line[1] != '=') {
+        return false;
+    }
+    while (pos < len && line[pos] >= '0' && line[pos] <= '9') {
+        v = 10*v + line[pos]-'0';
+        if (v > UINT32_MAX) {
+            return false;
+        }
+        pos++;
+    }
+    *val = v;
+
+    return pos != 2;
+}
+
+
+static bool handle_begin_frame(char* line, size_t len)
+{
+    uint32_t begin = 0;
+
+    if (!parse_frame_integer(line, len, 'b', &begin) || begin != 1) {
+        fprintf(stderr, "Received malformed begin frame command\n");
+        return false;
+    }
+
+    if (rec_frame) {
+        fprintf(stderr, "Frame started inside a frame\n");
+        return false;
+    }
+
+    // Samples from before the frame go out on their own.
+    if (current_sample_entry && !push_samples()) {
+        return false;
+    }
+
+    rec_frame = calloc(1, sizeof(struct frame));
+    if (rec_frame == NULL) {
+        fprintf(stderr, "Frame alloc failed\n");
+        return false;
+    }
+
+    return grow_frame();
+}
+
+
+static bool handle_loop_frame(char* line, size_t len)
+{
+    struct sample_packet *pkt;
+    struct frame *frame = rec_frame;
+    uint32_t loops = 0, i;
+
+    if (!parse_frame_integer(line, len, 'l', &loops)) {
+        fprintf(stderr, "Received malformed loop command\n");
+        return false;
+    }
+
+    if (frame == NULL) {
+        fprintf(stderr, "Loop command without a frame\n");
+        return false;
+    }
+
+    frame->count += current_sample_entry;
+    if (frame->count == 0) {
+        fprintf(stderr, "Received empty frame\n");
+        return false;
+    }
+
+    // grow_frame() left room for one packet past the end.
+    for (i = 0; i < lasershark_bulk_packet_sample_count; i++) {
+        frame->samples[frame->count + i] = frame->samples[i % frame->count];
+    }
+
+    rec_frame = NULL;
+    samples = cur_packet->samples;
+    current_sample_entry = 0;
+
+    pkt = queue_pop_wait(&packet_free_queue);
+    if (pkt == NULL) {
+        free(frame->samples);
+        free(frame);
+        return false;
+    }
+    pkt->type = PACKET_FRAME;
+    pkt->frame = frame;
+    pkt->loops = loops;
+    pkt->line_number = line_number;
+
+    return queue_push_wait(&packet_queue, pkt);
+}
+
+
+// Sample integers are parsed this way vs scanf/etc for speed reasons.
+static bool inline parse_sample_integer(char* line, size_t len, unsigned int *pos, unsigned int *val)
+{
+    unsigned int orig_pos = *pos;
+    *val = 0;
+    while (*pos < len && line[*pos] >= '0' && line[*pos] <= '9') {
+        *val = 10*(*val) + line[*pos]-'0';
+        (*pos)++;
+        if (*val > lasershark_dac_max_val) {
+            return false;
+        }
+    }
+
+    return orig_pos != *pos;
+}
+
+
+static bool handle_sample(char* line, size_t len)
+{
+    unsigned int x, y, a, b, c, intl_a;
+    unsigned int pos;
+
+#ifdef SWAR_PARSE
+    if (swar_parse_sample(line, len, &x, &y, &a, &b, &c, &intl_a)) {
+        goto store;
+    }
+#endif
+
+    // Lets make a giant if statement for fun
+    if (
+        len < 14 ||
+        (pos = 0, line[pos] != 's') || (pos++, line[pos] != '=') ||
+        (pos++, !parse_sample_integer(line, len, &pos, &x)) ||
+        pos >= len || line[pos] !=',' ||
+        (pos++, !parse_sample_integer(line, len, &pos, &y)) ||
+        pos >= len || line[pos] !=',' ||
+        (pos++, !parse_sample_integer(line, len, &pos, &a)) ||
+        pos >= len || line[pos] !=',' ||
+        (pos++, !parse_sample_integer(line, len, &pos, &b)) ||
+        pos >= len || line[pos] !=',' ||
+        (pos++, pos >= len) || (c=line[pos]-'0', c > 1) ||
+        (pos++, pos >= len) || line[pos] !=',' ||
+        (pos++, pos >= len) || (intl_a=line[pos]-'0', intl_a > 1)
+    ) {
+        fprintf(stderr, "Received bad sample command\n");
+        return false;
+    }
+
+#ifdef SWAR_PARSE
+store:
+#endif
+    samples[current_sample_entry].x = x;
+    samples[current_sample_entry].y = y;
+    samples[current_sample_entry].a = a;
+    samples[current_sample_entry].b = b;
+    samples[current_sample_entry].c = c;
+    samples[current_sample_entry].intl_a = intl_a;
+
+    current_sample_entry++;
+
+    if (current_sample_entry == lasershark_bulk_packet_sample_count) {
+        return push_samples();
+    }
+
+    return true;
+}
+
+
+static bool handle_set_ilda_rate(char* line, size_t len)
+{
+    uint32_t rate = 0;
+    int rc;
+    if (1 != sscanf(line, "r=%u", &rate)) {
+        fprintf(stderr, "Received malformated ilda rate command\n");
+        return false;
+    }
+
+    if (rate == 0 || rate > lasershark_max_ilda_rate) {
+        fprintf(stderr, "Received ilda rate outside acceptable range\n");
+    }
+
+    lasershark_ilda_rate = rate;
+    set_pace_target();
+    rc = set_ilda_rate(ls_devh, lasershark_ilda_rate);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "setting ILDA rate failed\n");
+        return false;
+    }
+    printf("Setting ILDA rate worked: %u pps\n", lasershark_ilda_rate);
+
+    return true;
+}
+
+
+static bool handle_set_output(char*line, size_t len)
+{
+    uint32_t enable = 0;
+    int rc;
+
+    if (1 != sscanf(line, "e=%u", &enable)) {
+        fprintf(stderr, "Received malfored enable command\n");
+        return false;
+    }
+
+
+    rc = set_output(ls_devh, enable ? LASERSHARK_CMD_OUTPUT_ENABLE : LASERSHARK_CMD_OUTPUT_DISABLE);
+    if (rc != LASERSHARK_CMD_SUCCESS)
+    {
+        fprintf(stderr, "Setting output failed\n");
+        return false;
+    }
+    if (enable) {
+        fprintf(stderr, "Setting output output worked: %u\n", enable);
+    }
+    return true;
+}
+
+
+static bool handle_print(char* line, size_t len)
+{
+    bool rc = false;
+    if (len > 2 && line[1] == '=') {
+        printf("PRINT: %s", line+2);
+        rc = true;
+    }
+    return rc;
+}
+
+
+static bool handle_flush(char* line, size_t len)
+{
+    int rc;
+    uint32_t empty_samples;
+    uint64_t wait_us;
+
+    // The parser queued any partial packet ahead of this command.
+    if (!wait_for_bulk_transfers()) {
+        return false;
+    }
+
+    printf("Flushing...\n");
+    while (1) {
+        rc = get_ringbuffer_empty_sample_count(ls_devh, &empty_samples);
+        if (rc != LASERSHARK_CMD_SUCCESS)
+        {
+            fprintf(stderr, "Getting ringbuffer empty sample count failed.\n");
+            return false;
+        }
+        atomic_store_explicit(&stat_ring_fill, lasershark_ringbuffer_sample_count - empty_samples,
+                              memory_order_relaxed);
+
+        if (do_exit || empty_samples == lasershark_ringbuffer_sample_count) {
+            break;
+        }
+
+        // Whatever is left drains at the ILDA rate, so sleep until then and poll finely after.
+        wait_us = FLUSH_POLL_MS*1000;
+        if (lasershark_ilda_rate) {
+            wait_us = (uint64_t)(lasershark_ringbuffer_sample_count - empty_samples)*1000000/lasershark_ilda_rate;
+            if (wait_us < FLUSH_POLL_MS*1000) {
+                wait_us = FLUSH_POLL_MS*1000;
+            }
+            if (wait_us > FLUSH_MAX_SLEEP_MS*1000) {
+                wait_us = FLUSH_MAX_SLEEP_MS*1000;
+            }
+        }
+        sleep_us(wait_us);
+    }
+
+    ring_drained = true;
+    printf("Flush done\n");
+    return true;
+}
+
+
+static bool process_line(char* line, size_t len)
+{
+    bool rc = true;
+
+    if (len < 2) { // Empty lines are not accepted
+        fprintf(stderr, "Empty line encountered on line %" PRIu64 "\n", line_number);
+        return false;
+    }
+
+    if (rec_frame && line[0] != 's' && line[0] != 'l' && line[0] != '#') {
+        fprintf(stderr, "Only samples are allowed inside a frame\n");
+        rc = false;
+        goto out;
+    }
+
+    switch(line[0]) {
+    case 's':
+        rc = handle_sample(line, len);
+        break;
+    case 'b':
+        rc = handle_begin_frame(line, len);
+        break;
+    case 'l':
+        rc = handle_loop_frame(line, len);
+        break;
+    case 'f':
+        // Whatever is buffered has to go out before the flush can wait on it.
+        rc = (current_sample_entry == 0 || push_samples()) && push_command(line, len);
+        break;
+    case 'r':
+        ilda_rate_seen = true;
+        rc = push_command(line, len);
+        break;
+    case 'e':
+    case 'p':
+        rc = push_command(line, len);
+        break;
+    case '#': // Comment
+        break;
+    default:
+        fprintf(stderr, "Unknown command received\n");
+        rc = false;
+    }
+
+out:
+    if (!rc && input_running()) {
+        fprintf(stderr, "Error on line %" PRIu64 ": %.*s", line_number, (int)len, line);
+    }
+
+    line_number++;
+
+    return rc;
+}
+
+
+// Runs a control command on the USB thread.
+static bool run_command(struct sample_packet *pkt)
+{
+    bool rc = false;
+
+    switch(pkt->cmd[0]) {
+    case 'f':
+        rc = handle_flush(pkt->cmd, pkt->cmd_len);
+        break;
+    case 'r':
+        rc = handle_set_ilda_rate(pkt->cmd, pkt->cmd_len);
+        break;
+    case 'e':
+        rc = handle_set_output(pkt->cmd, pkt->cmd_len);
+        break;
+    case 'p':
+        rc = handle_print(pkt->cmd, pkt->cmd_len);
+        break;
+    }
+
+    if (!rc) {
+        fprintf(stderr, "Error on line %" PRIu64 ": %s", pkt->line_number, pkt->cmd);
+    }
+
+    return rc;
+}
+
+
+static bool process_input_line(char* line, size_t len)
+{
+    if (line_number == 0 && line[0] != 'r') {
+        fprintf(stderr, "First command did not specify ilda rate. Quitting.\n");
+        return false;
+    }
+
+    return process_line(line, len);
+}
+
+
+// Splits a chunk into lines. A line running off the end of the chunk is kept in line_carry.
+static bool parse_text_chunk(char *data, size_t len)
+{
+    char *nl, *buf;
+    size_t n;
+
+    while (len) {
+        nl = memchr(data, '\n', len);
+        n = nl ? (size_t)(nl - data) + 1 : len;
+
+        if (line_carry_len || nl == NULL) {
+            if (line_carry_len + n + LINE_PAD > line_carry_size) {
+                buf = realloc(line_carry, line_carry_len + n + LINE_PAD);
+                if (buf == NULL) {
+                    fprintf(stderr, "Line buffer realloc failed\n");
+                    return false;
+                }
+                line_carry = buf;
+                line_carry_size = line_carry_len + n + LINE_PAD;
+            }
+            memcpy(line_carry + line_carry_len, data, n);
+            line_carry_len += n;
+            data += n;
+            len -= n;
+
+            if (nl) {
+                n = line_carry_len;
+                line_carry_len = 0;
+                if (!process_input_line(line_carry, n)) {
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        if (!process_input_line(data, n)) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
 
-static bool inline send_samples(unsigned int sample_count)
+static bool handle_binary_record(const struct lasershark_sample *rec)
 {
-    int r, actual;
-    do {
-        r = libusb_bulk_transfer(ls_devh, (3 | LIBUSB_ENDPOINT_OUT), (unsigned char*)samples,
-                                 sizeof(struct lasershark_sample)*sample_count,
-                                 &actual, BULK_TIMEOUT);
-    } while (!do_exit && r == LIBUSB_ERROR_TIMEOUT);
+    if (rec->pad) {
+        if (rec->pad != BINARY_ESCAPE_CMD) {
+            fprintf(stderr, "Unknown binary escape record on record %" PRIu64 "\n", line_number);
+            return false;
+        }
+        binary_cmd_len = rec->b;
+        binary_cmd_have = 0;
+        if (binary_cmd_len == 0) {
+            return process_line(binary_cmd, 0);
+        }
+        return true;
+    }
+
+    if (!ilda_rate_seen) {
+        fprintf(stderr, "First command did not specify ilda rate. Quitting.\n");
+        return false;
+    }
 
-    if (r < 0 && r != LIBUSB_ERROR_TIMEOUT) {
-        fprintf(stderr, "Error sending sample packet: %s", libusb_error_name(r));
+    if (rec->a > lasershark_dac_max_val || rec->b > lasershark_dac_max_val ||
+            rec->x > lasershark_dac_max_val || rec->y > lasershark_dac_max_val) {
+        fprintf(stderr, "Received bad binary sample on record %" PRIu64 "\n", line_number);
         return false;
     }
+    line_number++;
+
+    samples[current_sample_entry++] = *rec;
+    if (current_sample_entry == lasershark_bulk_packet_sample_count) {
+        return push_samples();
+    }
 
     return true;
 }
 
 
-// Sample integers are parsed this way vs scanf/etc for speed reasons.
-static bool inline parse_sample_integer(char* line, size_t len, unsigned int *pos, unsigned int *val)
+// Binary records are copied from the chunk into the packet as is, no text parsing is done for them.
+static bool parse_binary_chunk(uint8_t *data, size_t len)
 {
-    unsigned int orig_pos = *pos;
-    *val = 0;
-    while (*pos < len && line[*pos] >= '0' && line[*pos] <= '9') {
-        *val = 10*(*val) + line[*pos]-'0';
-        (*pos)++;
-        if (*val > lasershark_dac_max_val) {
+    const size_t rec_len = sizeof(struct lasershark_sample);
+    size_t n;
+
+    while (len) {
+        if (binary_cmd_len) {
+            n = binary_cmd_len - binary_cmd_have;
+            n = n < len ? n : len;
+            memcpy(binary_cmd + binary_cmd_have, data, n);
+            binary_cmd_have += n;
+            data += n;
+            len -= n;
+
+            if (binary_cmd_have == binary_cmd_len) {
+                binary_cmd[binary_cmd_len] = '\0';
+                n = binary_cmd_len;
+                binary_cmd_len = 0;
+                if (!process_line(binary_cmd, n)) {
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        // A record split across chunks is assembled in binary_rec.
+        if (binary_rec_len || len < rec_len) {
+            n = rec_len - binary_rec_len;
+            n = n < len ? n : len;
+            memcpy(binary_rec + binary_rec_len, data, n);
+            binary_rec_len += n;
+            data += n;
+            len -= n;
+
+            if (binary_rec_len == rec_len) {
+                binary_rec_len = 0;
+                if (!handle_binary_record((struct lasershark_sample*)binary_rec)) {
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        if (!handle_binary_record((struct lasershark_sample*)data)) {
             return false;
         }
+        data += rec_len;
+        len -= rec_len;
     }
 
-    return orig_pos != *pos;
+    return true;
 }
 
 
-static bool handle_sample(char* line, size_t len)
+static void *reader_thread(void *arg)
 {
-    unsigned int x, y, a, b, c, intl_a;
-    unsigned int pos;
+    struct input_chunk *chunk;
+    int r;
 
-    // Lets make a giant if statement for fun
-    if (
-        len < 14 ||
-        (pos = 0, line[pos] != 's') || (pos++, line[pos] != '=') ||
-        (pos++, !parse_sample_integer(line, len, &pos, &x)) ||
-        pos >= len || line[pos] !=',' ||
-        (pos++, !parse_sample_integer(line, len, &pos, &y)) ||
-        pos >= len || line[pos] !=',' ||
-        (pos++, !parse_sample_integer(line, len, &pos, &a)) ||
-        pos >= len || line[pos] !=',' ||
-        (pos++, !parse_sample_integer(line, len, &pos, &b)) ||
-        pos >= len || line[pos] !=',' ||
-        (pos++, pos >= len) || (c=line[pos]-'0', c > 1) ||
-        (pos++, pos >= len) || line[pos] !=',' ||
-        (pos++, pos >= len) || (intl_a=line[pos]-'0', intl_a > 1)
-    ) {
-        fprintf(stderr, "Received bad sample command\n");
-        return false;
+    while ((chunk = queue_pop_wait(&input_free_queue)) != NULL) {
+        do {
+            r = read(input_fd, chunk->buf, INPUT_CHUNK_SIZE);
+        } while (r < 0 && errno == EINTR && !do_exit);
+
+        if (r < 0) {
+            fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+            r = 0;
+        }
+
+        chunk->data = chunk->buf;
+        chunk->len = r;
+        atomic_fetch_add_explicit(&stat_bytes_in, r, memory_order_relaxed);
+        if (!queue_push_wait(&input_queue, chunk) || r == 0) {
+            break;
+        }
     }
 
-    samples[current_sample_entry].x = x;
-    samples[current_sample_entry].y = y;
-    samples[current_sample_entry].a = a;
-    samples[current_sample_entry].b = b;
-    samples[current_sample_entry].c = c;
-    samples[current_sample_entry].intl_a = intl_a;
+    atomic_store(&reader_done, 1);
+    return NULL;
+}
 
-    current_sample_entry++;
 
-    if (current_sample_entry == lasershark_bulk_packet_sample_count) {
-        current_sample_entry = 0;
-        return send_samples(lasershark_bulk_packet_sample_count);
+#ifndef _WIN32
+// Hands out slices of the mapped input file, so lines are parsed where they lie without copying.
+static void *map_reader_thread(void *arg)
+{
+    struct input_chunk *chunk;
+    size_t off = 0, n, ahead;
+    long page = sysconf(_SC_PAGESIZE);
+
+    while ((chunk = queue_pop_wait(&input_free_queue)) != NULL) {
+        n = input_map_len - off;
+        if (n > INPUT_CHUNK_SIZE + LINE_PAD) {
+            // End the slice on a line boundary when there is one. At least LINE_PAD bytes of the
+            // file follow it for the SWAR parser to read past its last line.
+            n = INPUT_CHUNK_SIZE;
+            while (n && input_map[off + n - 1] != '\n') {
+                n--;
+            }
+            if (n == 0) {
+                n = INPUT_CHUNK_SIZE;
+            }
+            chunk->data = input_map + off;
+        } else {
+            // The SWAR parser reads a little past the last line, which could be past the mapping.
+            if (n > INPUT_CHUNK_SIZE) {
+                n = INPUT_CHUNK_SIZE;
+            }
+            if (n) {
+                memcpy(chunk->buf, input_map + off, n);
+            }
+            chunk->data = chunk->buf;
+        }
+        chunk->len = n;
+        off += n;
+        atomic_fetch_add_explicit(&stat_bytes_in, n, memory_order_relaxed);
+
+        // Fault in what the parser gets to next while it works on this slice.
+        ahead = input_map_len - off;
+        if (ahead > (size_t)INPUT_CHUNK_SIZE*INPUT_CHUNK_COUNT) {
+            ahead = (size_t)INPUT_CHUNK_SIZE*INPUT_CHUNK_COUNT;
+        }
+        if (ahead) {
+            madvise(input_map + off/page*page, ahead + off%page, MADV_WILLNEED);
+        }
+
+        if (!queue_push_wait(&input_queue, chunk) || n == 0) {
+            break;
+        }
     }
 
-    return true;
+    atomic_store(&reader_done, 1);
+    return NULL;
 }
 
 
-static bool handle_set_ilda_rate(char* line, size_t len)
+static bool map_input_file(const char* path)
 {
-    uint32_t rate = 0;
-    int rc;
-    if (1 != sscanf(line, "r=%u", &rate)) {
-        fprintf(stderr, "Received malformated ilda rate command\n");
-        return false;
-    }
+    struct stat st;
 
-    if (rate == 0 || rate > lasershark_max_ilda_rate) {
-        fprintf(stderr, "Received ilda rate outside acceptable range\n");
+    input_fd = open(path, O_RDONLY);
+    if (input_fd < 0 || fstat(input_fd, &st) < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return false;
     }
 
-    lasershark_ilda_rate = rate;
-    rc = set_ilda_rate(ls_devh, lasershark_ilda_rate);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        fprintf(stderr, "setting ILDA rate failed\n");
-        return false;
+    input_map_len = st.st_size;
+    if (input_map_len) {
+        input_map = mmap(NULL, input_map_len, PROT_READ, MAP_PRIVATE, input_fd, 0);
+        if (input_map == MAP_FAILED) {
+            fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+            input_map = NULL;
+            return false;
+        }
+        madvise(input_map, input_map_len, MADV_SEQUENTIAL);
     }
-    printf("Setting ILDA rate worked: %u pps\n", lasershark_ilda_rate);
 
+    close(input_fd);
+    input_fd = -1;
     return true;
 }
+#endif
 
 
-static bool handle_set_output(char*line, size_t len)
+static void *parser_thread(void *arg)
 {
-    uint32_t enable = 0;
-    int rc;
+    struct input_chunk *chunk;
+    bool ok;
+
+    ok = next_packet();
+    while (ok && (chunk = queue_pop_wait(&input_queue)) != NULL) {
+        if (chunk->len == 0) {
+            // Like getline, a last line without a newline still counts.
+            if (line_carry_len) {
+                ok = process_input_line(line_carry, line_carry_len);
+            }
+            if (binary_rec_len || binary_cmd_len) {
+                fprintf(stderr, "Truncated binary record on record %" PRIu64 "\n", line_number);
+                ok = false;
+            }
+            if (ok && rec_frame) {
+                fprintf(stderr, "Input ended inside a frame\n");
+                ok = false;
+            }
+            break;
+        }
 
-    if (1 != sscanf(line, "e=%u", &enable)) {
-        fprintf(stderr, "Received malfored enable command\n");
-        return false;
+        if (binary_input) {
+            ok = parse_binary_chunk((uint8_t*)chunk->data, chunk->len);
+        } else {
+            ok = parse_text_chunk(chunk->data, chunk->len);
+        }
+        atomic_store_explicit(&stat_lines, (unsigned int)line_number, memory_order_relaxed);
+        queue_push(&input_free_queue, chunk);
     }
 
+    // Let the USB thread finish everything queued so far, then stop the reader.
+    queue_push_wait(&packet_queue, &end_packet);
+    atomic_store(&pipeline_stop, 1);
 
-    rc = set_output(ls_devh, enable ? LASERSHARK_CMD_OUTPUT_ENABLE : LASERSHARK_CMD_OUTPUT_DISABLE);
-    if (rc != LASERSHARK_CMD_SUCCESS)
-    {
-        fprintf(stderr, "Setting output failed\n");
-        return false;
+    parser_ok = ok;
+    return NULL;
+}
+
+
+static void *usb_thread(void *arg)
+{
+    struct sample_packet *pkt;
+    unsigned int wait_us = QUEUE_WAIT_MIN_US;
+    bool ok = true;
+
+    while (ok && !do_exit) {
+        pkt = queue_pop(&packet_queue);
+        if (pkt == NULL) {
+            // Nothing new from the parser, keep servicing completions meanwhile. With -S the
+            // ringbuffer keeps being read so a stalled input shows up as an underrun.
+            if (bulk_free_count < BULK_TRANSFER_COUNT) {
+                ok = handle_bulk_events(wait_us);
+            } else {
+                sleep_us(wait_us);
+            }
+            if (ok && stats_file) {
+                ok = update_pace_model();
+            }
+            if (wait_us < QUEUE_WAIT_MAX_US) {
+                wait_us *= 2;
+            }
+            continue;
+        }
+        wait_us = QUEUE_WAIT_MIN_US;
+
+        if (pkt->type == PACKET_END) {
+            break;
+        } else if (pkt->type == PACKET_SAMPLES) {
+            ok = send_samples(pkt);
+        } else if (pkt->type == PACKET_FRAME) {
+            ok = replay_samples(pkt);
+            queue_push(&packet_free_queue, pkt);
+        } else {
+            ok = run_command(pkt);
+            queue_push(&packet_free_queue, pkt);
+        }
     }
-    if (enable) {
-        fprintf(stderr, "Setting output output worked: %u\n", enable);
+
+    if (!wait_for_bulk_transfers()) {
+        ok = false;
     }
-    return true;
+    if (!ok) {
+        atomic_store(&pipeline_stop, 1);
+    }
+
+    if (replay_frame) {
+        free(replay_frame->samples);
+        free(replay_frame);
+        replay_frame = NULL;
+    }
+
+    usb_ok = ok;
+    return NULL;
 }
 
 
-static bool handle_print(char* line, size_t len)
+// Reports the counters every STATS_INTERVAL_MS. Comparing the rates tells whether the input, the
+// parser or the Lasershark is holding things up.
+static void *stats_thread(void *arg)
 {
-    bool rc = false;
-    if (len > 2 && line[1] == '=') {
-        printf("PRINT: %s", line+2);
-        rc = true;
+    unsigned int lines, bytes_in, samples, bytes_out, transfers, stalls;
+    unsigned int prev_lines = 0, prev_bytes_in = 0, prev_samples = 0, prev_bytes_out = 0;
+    unsigned int prev_transfers = 0, prev_stalls = 0;
+    uint64_t total_samples = 0;
+    uint64_t last = now_us(), now;
+    double secs;
+
+    while (!do_exit && !atomic_load(&stats_stop)) {
+        sleep_us(STATS_INTERVAL_MS*1000/10);
+        now = now_us();
+        if (now - last < STATS_INTERVAL_MS*1000) {
+            continue;
+        }
+        secs = (now - last)/1000000.0;
+        last = now;
+
+        lines = atomic_load_explicit(&stat_lines, memory_order_relaxed);
+        bytes_in = atomic_load_explicit(&stat_bytes_in, memory_order_relaxed);
+        samples = atomic_load_explicit(&stat_samples, memory_order_relaxed);
+        bytes_out = atomic_load_explicit(&stat_bytes_out, memory_order_relaxed);
+        transfers = atomic_load_explicit(&stat_transfers, memory_order_relaxed);
+        stalls = atomic_load_explicit(&stat_stalls, memory_order_relaxed);
+        total_samples += samples - prev_samples;
+
+        fprintf(stats_file, "stats: %.0f lines/s, in %.0f B/s, out %.0f B/s, %.0f samples/s (%" PRIu64 " sent), "
+                "%u transfers (%u stalled), ringbuffer %u/%u, %u underruns\n",
+                (lines - prev_lines)/secs, (bytes_in - prev_bytes_in)/secs, (bytes_out - prev_bytes_out)/secs,
+                (samples - prev_samples)/secs, total_samples, transfers - prev_transfers, stalls - prev_stalls,
+                atomic_load_explicit(&stat_ring_fill, memory_order_relaxed), lasershark_ringbuffer_sample_count,
+                atomic_load_explicit(&stat_underruns, memory_order_relaxed));
+        fflush(stats_file);
+
+        prev_lines = lines;
+        prev_bytes_in = bytes_in;
+        prev_samples = samples;
+        prev_bytes_out = bytes_out;
+        prev_transfers = transfers;
+        prev_stalls = stalls;
     }
-    return rc;
+
+    return NULL;
 }
 
 
-static bool handle_flush(char* line, size_t len)
+static bool alloc_pipeline()
 {
-    int rc;
-    uint32_t empty_samples;
+    int i;
 
-    if (current_sample_entry != 0) {
-        if (!send_samples(current_sample_entry)) {
-            return false;
-        }
+    if (!queue_init(&input_queue, INPUT_CHUNK_COUNT) || !queue_init(&input_free_queue, INPUT_CHUNK_COUNT) ||
+            !queue_init(&packet_queue, PACKET_COUNT) || !queue_init(&packet_free_queue, PACKET_COUNT)) {
+        return false;
     }
 
-    current_sample_entry = 0;
-    printf("Flushing...\n");
-    while (1) {
-        rc = get_ringbuffer_empty_sample_count(ls_devh, &empty_samples);
-        if (rc != LASERSHARK_CMD_SUCCESS)
-        {
-            fprintf(stderr, "Getting ringbuffer empty sample count failed.\n");
+    for (i = 0; i < INPUT_CHUNK_COUNT; i++) {
+        input_chunks[i].buf = malloc(INPUT_CHUNK_SIZE + LINE_PAD);
+        if (input_chunks[i].buf == NULL) {
             return false;
         }
+        queue_push(&input_free_queue, &input_chunks[i]);
+    }
 
-        if (do_exit || empty_samples == lasershark_ringbuffer_sample_count) {
-            break;
+    for (i = 0; i < PACKET_COUNT; i++) {
+        packets[i].samples = malloc(sizeof(struct lasershark_sample)*lasershark_bulk_packet_sample_count);
+        if (packets[i].samples == NULL) {
+            return false;
         }
+        queue_push(&packet_free_queue, &packets[i]);
+    }
 
-        // TODO: Use something better than sleep
-#ifdef _WIN32
-        Sleep(1000);
-#else
-        sleep(1);
-#endif
-        printf("still flushing...\n");
+    binary_cmd = malloc(UINT16_MAX + 1);
+    if (binary_cmd == NULL) {
+        return false;
     }
 
-    printf("Flush done\n");
+    atomic_init(&pipeline_stop, 0);
+    atomic_init(&reader_done, 0);
+    atomic_init(&stats_stop, 0);
+
     return true;
 }
 
 
-static bool process_line(char* line, size_t len)
+static void free_pipeline()
 {
-    bool rc = true;
+    int i;
 
-    if (len < 2) { // Empty lines are not accepted
-        fprintf(stderr, "Empty line encountered on line %" PRIu64 "\n", line_number);
-        return false;
+    // A reader stuck in read() still owns its chunk, leave those to process exit.
+    if (atomic_load(&reader_done)) {
+        for (i = 0; i < INPUT_CHUNK_COUNT; i++) {
+            free(input_chunks[i].buf);
+        }
+        free(input_queue.items);
+        free(input_free_queue.items);
     }
 
-    switch(line[0]) {
-    case 's':
-        rc = handle_sample(line, len);
-        break;
-    case 'f':
-        rc = handle_flush(line, len);
-        break;
-    case 'r':
-        rc = handle_set_ilda_rate(line, len);
-        break;
-    case 'e':
-        rc = handle_set_output(line, len);
-        break;
-    case 'p':
-        rc = handle_print(line, len);
-        break;
-    case '#': // Comment
-        break;
-    default:
-        fprintf(stderr, "Unknown command received\n");
-        rc = false;
+    for (i = 0; i < PACKET_COUNT; i++) {
+        free(packets[i].samples);
+        free(packets[i].cmd);
+        if (packets[i].frame) { // Frame the USB thread never got to
+            free(packets[i].frame->samples);
+            free(packets[i].frame);
+        }
+    }
+    free(packet_queue.items);
+    free(packet_free_queue.items);
+    free(line_carry);
+    free(binary_cmd);
+    if (rec_frame) {
+        free(rec_frame->samples);
+        free(rec_frame);
     }
+}
 
-    if (!rc) {
-        fprintf(stderr, "Error on line %" PRIu64 ": %s", line_number, line);
+
+// Reader, parser and USB submission each get a thread so a slow pipe or a USB stall only
+// holds up its own stage.
+static bool run_pipeline()
+{
+    void *(*reader)(void*) = reader_thread;
+
+#ifndef _WIN32
+    if (input_fd < 0) {
+        reader = map_reader_thread;
     }
+#endif
 
-    line_number++;
+    if (stats_file && pthread_create(&stats_tid, NULL, stats_thread, NULL)) {
+        fprintf(stderr, "Could not start stats thread\n");
+        if (stats_file != stderr) {
+            fclose(stats_file);
+        }
+        stats_file = NULL;
+    }
 
-    return rc;
+    if (pthread_create(&usb_tid, NULL, usb_thread, NULL)) {
+        fprintf(stderr, "Could not start USB thread\n");
+        return false;
+    }
+    if (pthread_create(&parser_tid, NULL, parser_thread, NULL)) {
+        fprintf(stderr, "Could not start parser thread\n");
+        queue_push(&packet_queue, &end_packet);
+        pthread_join(usb_tid, NULL);
+        if (stats_file) {
+            atomic_store(&stats_stop, 1);
+            pthread_join(stats_tid, NULL);
+        }
+        return false;
+    }
+    if (pthread_create(&reader_tid, NULL, reader, NULL)) {
+        fprintf(stderr, "Could not start reader thread\n");
+        atomic_store(&pipeline_stop, 1);
+        atomic_store(&reader_done, 1);
+    }
+
+    pthread_join(parser_tid, NULL);
+    pthread_join(usb_tid, NULL);
+
+    if (stats_file) {
+        atomic_store(&stats_stop, 1);
+        pthread_join(stats_tid, NULL);
+    }
+
+    if (atomic_load(&reader_done)) {
+        pthread_join(reader_tid, NULL);
+    } else {
+        // Blocked waiting on input that is no longer wanted.
+        pthread_cancel(reader_tid);
+        pthread_detach(reader_tid);
+    }
+
+    return parser_ok && usb_ok;
 }
 
 
@@ -467,6 +1865,14 @@ void print_help(const char* prog_name, FILE* stream)
     fprintf(stream, "\tLists all connected LaserSharks\n");
     fprintf(stream, "\t-s <LaserShark Serial Number>\n");
     fprintf(stream, "\t\tConnect to a specific LaserShark\n");
+    fprintf(stream, "\t-t <Target latency in ms>\n");
+    fprintf(stream, "\t\tPace writes to keep this much output queued (default: whole ringbuffer)\n");
+    fprintf(stream, "\t-f <Command file>\n");
+    fprintf(stream, "\t\tRead commands from a file instead of stdin\n");
+    fprintf(stream, "\t-b");
+    fprintf(stream, "\tRead packed binary sample records instead of text commands\n");
+    fprintf(stream, "\t-S <Stats file, - for stderr>\n");
+    fprintf(stream, "\t\tReport throughput and ringbuffer fill once a second\n");
 }
 
 
@@ -478,7 +1884,13 @@ int main (int argc, char *argv[])
     int hflag = 0;
     int lflag = 0;
     int sflag = 0;
+    int bflag = 0;
+    int tflag = 0;
+    int fflag = 0;
+    int Sflag = 0;
     char* requested_serial = NULL;
+    char* input_path = NULL;
+    char* stats_path = NULL;
     int c;
 
 #ifndef _WIN32
@@ -486,7 +1898,7 @@ int main (int argc, char *argv[])
 #endif
 
     opterr_portable = 1;
-    while (-1 != (c =getopt_portable(argc, argv, "hls:"))) {
+    while (-1 != (c =getopt_portable(argc, argv, "hls:bt:f:S:"))) {
         switch(c) {
         case 'h':
             hflag++;
@@ -498,6 +1910,21 @@ int main (int argc, char *argv[])
             sflag++;
             requested_serial = optarg_portable;
             break;
+        case 'b':
+            bflag++;
+            break;
+        case 'f':
+            fflag++;
+            input_path = optarg_portable;
+            break;
+        case 't':
+            tflag++;
+            target_latency_ms = atoi(optarg_portable);
+            break;
+        case 'S':
+            Sflag++;
+            stats_path = optarg_portable;
+            break;
         default:
             print_help(argv[0], stderr);
             exit(1);
@@ -510,7 +1937,7 @@ int main (int argc, char *argv[])
         exit(1);
     }
 
-    if (lflag > 1 || sflag > 1 || hflag > 1) {
+    if (lflag > 1 || sflag > 1 || hflag > 1 || bflag > 1 || tflag > 1 || fflag > 1 || Sflag > 1) {
         fprintf(stderr, "Cannot specify flags more than once.\n");
         print_help(argv[0], stderr);
         exit(1);
@@ -521,6 +1948,35 @@ int main (int argc, char *argv[])
         exit(0);
     }
 
+    if (tflag && target_latency_ms == 0) {
+        fprintf(stderr, "Target latency must be greater than 0 ms.\n");
+        print_help(argv[0], stderr);
+        exit(1);
+    }
+
+    if (Sflag) {
+        stats_file = strcmp(stats_path, "-") ? fopen(stats_path, "w") : stderr;
+        if (stats_file == NULL) {
+            fprintf(stderr, "Could not open %s: %s\n", stats_path, strerror(errno));
+            exit(1);
+        }
+    }
+
+    input_fd = fileno(stdin);
+    if (fflag) {
+#ifdef _WIN32
+        input_fd = open(input_path, O_RDONLY | O_BINARY);
+        if (input_fd < 0) {
+            fprintf(stderr, "Could not open %s: %s\n", input_path, strerror(errno));
+            exit(1);
+        }
+#else
+        if (!map_input_file(input_path)) {
+            exit(1);
+        }
+#endif
+    }
+
 #ifndef _WIN32
     sigact.sa_handler = sig_hdlr;
     sigemptyset(&sigact.sa_mask);
@@ -611,9 +2067,8 @@ int main (int argc, char *argv[])
     }
     printf("Getting bulk packet sample count: %d\n", lasershark_bulk_packet_sample_count);
 
-    samples = malloc(sizeof(struct lasershark_sample)*lasershark_bulk_packet_sample_count);
-    if (samples == NULL) {
-        fprintf(stderr, "Could not allocate sample array.\n");
+    if (!alloc_bulk_transfers() || !alloc_pipeline()) {
+        fprintf(stderr, "Could not allocate bulk transfers.\n");
         goto out;
     }
 
@@ -650,6 +2105,7 @@ int main (int argc, char *argv[])
         goto out;
     }
     printf("Getting ringbuffer sample count: %d\n", lasershark_ringbuffer_sample_count);
+    set_pace_target();
 
 
     rc = get_ringbuffer_empty_sample_count(ls_devh, &temp);
@@ -667,14 +2123,12 @@ int main (int argc, char *argv[])
     }
     printf("Disable output worked\n");
 
-    ssize_t read;
-    size_t len = 256;
-
-    char *line = malloc(len+1);
-    if (line == NULL) {
-        fprintf(stderr, "Buffer malloc failed\n");
-        goto out;
+    binary_input = bflag;
+#ifdef _WIN32
+    if (binary_input && !fflag) {
+        _setmode(_fileno(stdin), _O_BINARY);
     }
+#endif
 
 #ifdef _WIN32
     SetConsoleCtrlHandler(console_ctrl_handler, TRUE);
@@ -687,15 +2141,7 @@ int main (int argc, char *argv[])
 
     printf("===Running===\n");
 
-    if (-1 == (read = getline_portable(&line, &len, stdin)) || read < 1 || line[0] != 'r' || !process_line(line, read)) {
-        fprintf(stderr, "First command did not specify ilda rate. Quitting.\n");
-    } else {
-        while (!do_exit && -1 != (read = getline_portable(&line, &len, stdin)) && process_line(line, read)) {
-            //sigsuspend (&oldmask);
-            //printf("Looping... (Must have recieved a signal, don't panic).\n");
-        }
-        //sigprocmask (SIG_UNBLOCK, &mask, NULL);
-    }
+    run_pipeline();
 
     printf("===Ending===\n");
     rc = set_output(ls_devh, LASERSHARK_CMD_OUTPUT_DISABLE);
@@ -730,6 +2176,7 @@ int main (int argc, char *argv[])
     printf("Quitting gracefully\n");
 
 out:
+    free_bulk_transfers();
     libusb_release_interface(ls_devh, 0);
     libusb_release_interface(ls_devh, 1);
 
@@ -740,6 +2187,16 @@ out_post_release:
     }
     libusb_exit(NULL);
 
+    free_pipeline();
+#ifndef _WIN32
+    if (input_map) {
+        munmap(input_map, input_map_len);
+    }
+#endif
+    if (stats_file && stats_file != stderr) {
+        fclose(stats_file);
+    }
+
 
     return rc;
 }
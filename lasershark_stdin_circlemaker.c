@@ -40,17 +40,15 @@ int main (int argc, char *argv[])
     x_f = 0;
     y_f = 0;
 
-    while(1) {
+    printf("b=1\n"); // record one frame, lasershark_stdin repeats it
+    for (index = 0; index < 1000; index++) {
         x_f = sinf(index*step);
         y_f = cosf(index*step);
         printf("s=%u,%u,%u,%u,%u,%u\n",
                float_to_lasershark_xy(x_f),  float_to_lasershark_xy(y_f), 4095,4095,1,1); // x, y, a, b, c, intl_a
-        index++;
     }
+    printf("l=0\n"); // loop the frame until interrupted
 
-    // These should really be stuck at the end of the output.. but this is just a demo.
-    //printf("f=1\n");
-    //printf("e=0\n");
     return 0;
 }
 
@@ -205,61 +205,58 @@ int main (int argc, char *argv[])
     printf("r=%d\n",rate);
     printf("e=1\n");
 
-    while(1) {
-
-        // top sweep
-        if (Aflag == 1 || Tflag == 1)
-            for (count = MIN_VAL; count < MAX_VAL; count += step)
-                send_scaled(x_scalar, y_scalar, m_factor, e_factor,
-                    count, MIN_VAL, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
-
-        // top sweep back
-        if (Tflag == 1)
-            for (count = MAX_VAL; count > MIN_VAL; count -= step)
-                send_scaled(x_scalar, y_scalar, m_factor, e_factor,
-                    count, MIN_VAL, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
-
-        // down right side
-        if (Aflag == 1 || Rflag == 1)
-            for (count = MIN_VAL; count < MAX_VAL; count += step)
-                send_scaled(x_scalar, y_scalar, m_factor, e_factor,
-                    MAX_VAL, count, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
-
-        // back up right side
-        if (Rflag == 1)
-            for (count = MAX_VAL; count > MIN_VAL; count -= step)
-                send_scaled(x_scalar, y_scalar, m_factor, e_factor,
-                    MAX_VAL, count, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
-
-        // bottom sweep
-        if (Aflag == 1 || Bflag == 1)
-            for (count = MAX_VAL; count > MIN_VAL; count -= step)
-                send_scaled(x_scalar, y_scalar, m_factor, e_factor,
-                    count, MAX_VAL, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
-
-        // bottom sweep back
-        if (Bflag == 1)
-            for (count = MIN_VAL; count < MAX_VAL; count += step)
-                send_scaled(x_scalar, y_scalar, m_factor, e_factor,
-                    count, MAX_VAL, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
-
-        // up left side
-        if (Aflag == 1 || Lflag == 1)
-            for (count = MAX_VAL; count > MIN_VAL; count -= step)
-                send_scaled(x_scalar, y_scalar, m_factor, e_factor,
-                    MIN_VAL, count, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
-
-        // back down left side
-        if (Lflag == 1)
-            for (count = MIN_VAL; count < MAX_VAL; count += step)
-                send_scaled(x_scalar, y_scalar, m_factor, e_factor,
-                    MIN_VAL, count, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
+    printf("b=1\n"); // record one frame, lasershark_stdin repeats it
+
+    // top sweep
+    if (Aflag == 1 || Tflag == 1)
+        for (count = MIN_VAL; count < MAX_VAL; count += step)
+            send_scaled(x_scalar, y_scalar, m_factor, e_factor,
+                count, MIN_VAL, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
+
+    // top sweep back
+    if (Tflag == 1)
+        for (count = MAX_VAL; count > MIN_VAL; count -= step)
+            send_scaled(x_scalar, y_scalar, m_factor, e_factor,
+                count, MIN_VAL, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
+
+    // down right side
+    if (Aflag == 1 || Rflag == 1)
+        for (count = MIN_VAL; count < MAX_VAL; count += step)
+            send_scaled(x_scalar, y_scalar, m_factor, e_factor,
+                MAX_VAL, count, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
+
+    // back up right side
+    if (Rflag == 1)
+        for (count = MAX_VAL; count > MIN_VAL; count -= step)
+            send_scaled(x_scalar, y_scalar, m_factor, e_factor,
+                MAX_VAL, count, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
+
+    // bottom sweep
+    if (Aflag == 1 || Bflag == 1)
+        for (count = MAX_VAL; count > MIN_VAL; count -= step)
+            send_scaled(x_scalar, y_scalar, m_factor, e_factor,
+                count, MAX_VAL, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
+
+    // bottom sweep back
+    if (Bflag == 1)
+        for (count = MIN_VAL; count < MAX_VAL; count += step)
+            send_scaled(x_scalar, y_scalar, m_factor, e_factor,
+                count, MAX_VAL, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
+
+    // up left side
+    if (Aflag == 1 || Lflag == 1)
+        for (count = MAX_VAL; count > MIN_VAL; count -= step)
+            send_scaled(x_scalar, y_scalar, m_factor, e_factor,
+                MIN_VAL, count, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
+
+    // back down left side
+    if (Lflag == 1)
+        for (count = MIN_VAL; count < MAX_VAL; count += step)
+            send_scaled(x_scalar, y_scalar, m_factor, e_factor,
+                MIN_VAL, count, 4095, 4095, 1, 1); // x_scalar, y_scalar, m_factor, e_factor, x, y, a, b, c, intl_a
+
+    printf("l=0\n"); // loop the frame until interrupted
 
-    }
-
-
-    printf("f=1\n");
-    printf("e=0\n");
     return 0;
 }
 
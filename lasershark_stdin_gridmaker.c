@@ -131,35 +131,30 @@ int main (int argc, char *argv[])
 
     printf("r=%i\n", refreshRate); // set refresh rate
     printf("e=1\n"); // start the stream
+    printf("b=1\n"); // record one frame, lasershark_stdin repeats it
+
+    while(x_f <= (1.01)) { // display vertical lines
+        printf("s=%u,%u,%u,%u,%u,%u\n", 
+            float_to_lasershark_xy(x_f, x_size), float_to_lasershark_xy(y_f, y_size), 0,0,0,0); // x, y, a, b, c, intl_a
+        y_f = -y_f; // span across
+        printf("s=%u,%u,%u,%u,%u,%u\n",
+            float_to_lasershark_xy(x_f, x_size), float_to_lasershark_xy(y_f, y_size), 4095,4095,1,1); // x, y, a, b, c, intl_a
+        x_f += step; // next line
+    }
 
-    while(1) {  // main loop
-        while(x_f <= (1.01)) { // display vertical lines
-            printf("s=%u,%u,%u,%u,%u,%u\n", 
-                float_to_lasershark_xy(x_f, x_size), float_to_lasershark_xy(y_f, y_size), 0,0,0,0); // x, y, a, b, c, intl_a
-            y_f = -y_f; // span across
-            printf("s=%u,%u,%u,%u,%u,%u\n",
-                float_to_lasershark_xy(x_f, x_size), float_to_lasershark_xy(y_f, y_size), 4095,4095,1,1); // x, y, a, b, c, intl_a
-            x_f += step; // next line
-        }
-
-        x_f = 1; // because it will already be over there
-        y_f = -1; // reset for vertical lines
-
-        while(y_f <= (1.01)) { // display horizontal lines
-            printf("s=%u,%u,%u,%u,%u,%u\n",
-                float_to_lasershark_xy(x_f, x_size), float_to_lasershark_xy(y_f, y_size), 0,0,0,0); // x, y, a, b, c, intl_a
-            x_f = -x_f; // span across
-            printf("s=%u,%u,%u,%u,%u,%u\n",
-                float_to_lasershark_xy(x_f, x_size), float_to_lasershark_xy(y_f, y_size), 4095,4095,1,1); // x, y, a, b, c, intl_a
-            y_f += step; // next line
-        }
+    x_f = 1; // because it will already be over there
+    y_f = -1; // reset for vertical lines
 
-        y_f = -1; // reinitialize
-        x_f = -1; // reinitialize
+    while(y_f <= (1.01)) { // display horizontal lines
+        printf("s=%u,%u,%u,%u,%u,%u\n",
+            float_to_lasershark_xy(x_f, x_size), float_to_lasershark_xy(y_f, y_size), 0,0,0,0); // x, y, a, b, c, intl_a
+        x_f = -x_f; // span across
+        printf("s=%u,%u,%u,%u,%u,%u\n",
+            float_to_lasershark_xy(x_f, x_size), float_to_lasershark_xy(y_f, y_size), 4095,4095,1,1); // x, y, a, b, c, intl_a
+        y_f += step; // next line
     }
 
-    // These should really be stuck at the end of the output.. but this is a loop.
-    //printf("f=1\n");
-    //printf("e=0\n");
+    printf("l=0\n"); // loop the frame until interrupted
+
     return 0;
 }
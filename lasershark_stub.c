@@ -0,0 +1,509 @@
+/*
+lasershark_stub.c - Stand-in for libusb and lasershark_lib that simulates a Lasershark, so
+lasershark_stdin can be benchmarked without one attached.
+
+This file is part of Lasershark's USB Host App.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Environment:
+//   LASERSHARK_STUB_RATE   Samples per second the simulated ringbuffer drains at. Defaults to the
+//                          rate set with "r=". 0 drains instantly, which measures the host alone.
+//   LASERSHARK_STUB_INPUT  Workload file to feed to stdin through a pipe. The time each chunk is
+//                          written is recorded so the end-to-end latency of text samples can be
+//                          reported.
+//
+// A summary is printed to stderr at exit.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <libusb.h>
+#include "lasersharklib/lasershark_lib.h"
+
+
+#define STUB_SAMPLE_BYTES 8
+#define STUB_BULK_PACKET_SAMPLES 64
+#define STUB_RINGBUFFER_SAMPLES 4096
+// With an instant drain the ringbuffer is made big enough that pacing never holds the host back.
+#define STUB_UNTHROTTLED_RINGBUFFER_SAMPLES (1 << 20)
+#define STUB_MAX_ILDA_RATE 64000
+#define STUB_DAC_MAX 4095
+#define STUB_PENDING_COUNT 64
+
+#define FEED_CHUNK_SIZE 4096
+
+
+static int stub_device; // Address stands in for the device and its handle
+static libusb_device *stub_device_list[2] = { (libusb_device*)&stub_device, NULL };
+
+static long stub_rate_override = -1;
+static uint32_t stub_ilda_rate = 0;
+static uint32_t stub_ringbuffer_samples = STUB_RINGBUFFER_SAMPLES;
+
+// Simulated ringbuffer. Transfers are accepted in order while they fit.
+static double ring_fill = 0;
+static double ring_last = 0;
+static struct libusb_transfer *pending[STUB_PENDING_COUNT];
+static bool pending_cancelled[STUB_PENDING_COUNT];
+static unsigned int pending_head = 0, pending_count = 0;
+
+static uint64_t total_samples = 0;
+static uint64_t total_transfers = 0;
+static double first_accept = 0, last_play = 0;
+
+// Workload feeder. Checkpoint i records when the chunk holding samples up to feed_samples[i] was written.
+static int feed_fd = -1;
+static int feed_pipe = -1; // Write end of the pipe that replaced stdin
+static size_t feed_len = 0;
+static uint64_t *feed_samples = NULL;
+static double *feed_times = NULL;
+static atomic_size_t feed_count;
+static pthread_t feed_tid;
+static size_t latency_pos = 0;
+static double latency_sum = 0, latency_max = 0;
+static uint64_t latency_count = 0;
+
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+
+static uint32_t drain_rate()
+{
+    return stub_rate_override >= 0 ? (uint32_t)stub_rate_override : stub_ilda_rate;
+}
+
+
+static void drain_ring()
+{
+    double t = now();
+
+    if (stub_rate_override == 0) {
+        ring_fill = 0;
+    } else if (ring_last) {
+        ring_fill -= (t - ring_last)*drain_rate();
+        if (ring_fill < 0) {
+            ring_fill = 0;
+        }
+    }
+    ring_last = t;
+}
+
+
+// Matches the first sample of an accepted transfer with the time it was written to the pipe.
+static void record_latency(double play)
+{
+    size_t count = atomic_load_explicit(&feed_count, memory_order_acquire);
+
+    while (latency_pos < count && feed_samples[latency_pos] <= total_samples) {
+        latency_pos++;
+    }
+    if (latency_pos == count) {
+        return;
+    }
+
+    play -= feed_times[latency_pos];
+    latency_sum += play;
+    if (play > latency_max) {
+        latency_max = play;
+    }
+    latency_count++;
+}
+
+
+static void accept_transfer(struct libusb_transfer *transfer)
+{
+    uint32_t samples = transfer->length/STUB_SAMPLE_BYTES;
+    double t = now(), play = t;
+
+    if (drain_rate()) {
+        play += ring_fill/drain_rate();
+    }
+    if (first_accept == 0) {
+        first_accept = t;
+    }
+
+    if (feed_samples) {
+        record_latency(play);
+    }
+
+    ring_fill += samples;
+    total_samples += samples;
+    total_transfers++;
+    last_play = drain_rate() ? t + ring_fill/drain_rate() : t;
+}
+
+
+static void *feed_thread(void *arg)
+{
+    char buf[FEED_CHUNK_SIZE];
+    uint64_t samples = 0;
+    bool line_start = true;
+    ssize_t r, w, off;
+    size_t i;
+
+    while ((r = read(feed_fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < (size_t)r; i++) {
+            if (line_start && buf[i] == 's') {
+                samples++;
+            }
+            line_start = buf[i] == '\n';
+        }
+
+        // Published before the write, so the stub never sees a sample ahead of its checkpoint.
+        i = atomic_load_explicit(&feed_count, memory_order_relaxed);
+        feed_samples[i] = samples;
+        feed_times[i] = now();
+        atomic_store_explicit(&feed_count, i + 1, memory_order_release);
+
+        for (off = 0; off < r; off += w) {
+            w = write(feed_pipe, buf + off, r - off);
+            if (w <= 0) {
+                return NULL;
+            }
+        }
+    }
+
+    close(feed_pipe);
+    return NULL;
+}
+
+
+static void report()
+{
+    double elapsed = last_play - first_accept;
+
+    fprintf(stderr, "lasershark_stub: %" PRIu64 " samples in %" PRIu64 " transfers", total_samples, total_transfers);
+    if (elapsed > 0) {
+        fprintf(stderr, ", %.3f s, %.0f samples/s", elapsed, total_samples/elapsed);
+    }
+    if (total_samples) {
+        fprintf(stderr, ", %.0f ns CPU/sample", (double)clock()/CLOCKS_PER_SEC*1e9/total_samples);
+    }
+    if (latency_count) {
+        fprintf(stderr, ", latency avg %.2f ms max %.2f ms", latency_sum/latency_count*1000, latency_max*1000);
+    }
+    fprintf(stderr, "\n");
+}
+
+
+__attribute__((constructor)) static void stub_init()
+{
+    const char *rate = getenv("LASERSHARK_STUB_RATE");
+    const char *input = getenv("LASERSHARK_STUB_INPUT");
+    struct stat st;
+    int fds[2];
+
+    if (rate && *rate) {
+        stub_rate_override = atol(rate);
+        if (stub_rate_override == 0) {
+            stub_ringbuffer_samples = STUB_UNTHROTTLED_RINGBUFFER_SAMPLES;
+        }
+    }
+
+    atomic_init(&feed_count, 0);
+    if (input) {
+        feed_fd = open(input, O_RDONLY);
+        if (feed_fd < 0 || fstat(feed_fd, &st) < 0) {
+            fprintf(stderr, "lasershark_stub: could not open %s: %s\n", input, strerror(errno));
+            exit(1);
+        }
+        feed_len = st.st_size;
+        feed_samples = malloc(sizeof(uint64_t)*(feed_len/FEED_CHUNK_SIZE + 1));
+        feed_times = malloc(sizeof(double)*(feed_len/FEED_CHUNK_SIZE + 1));
+
+        if (feed_samples == NULL || feed_times == NULL || pipe(fds) < 0 || dup2(fds[0], STDIN_FILENO) < 0) {
+            fprintf(stderr, "lasershark_stub: could not set up the input pipe\n");
+            exit(1);
+        }
+        close(fds[0]);
+        feed_pipe = fds[1];
+        signal(SIGPIPE, SIG_IGN);
+
+        if (pthread_create(&feed_tid, NULL, feed_thread, NULL)) {
+            fprintf(stderr, "lasershark_stub: could not start the feeder thread\n");
+            exit(1);
+        }
+        pthread_detach(feed_tid);
+    }
+
+    atexit(report);
+}
+
+
+int LIBUSB_CALL libusb_init(libusb_context **ctx)
+{
+    return LIBUSB_SUCCESS;
+}
+
+
+void LIBUSB_CALL libusb_exit(libusb_context *ctx)
+{
+}
+
+
+void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level)
+{
+}
+
+
+const char * LIBUSB_CALL libusb_error_name(int errcode)
+{
+    return "LIBUSB_STUB_ERROR";
+}
+
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+    *list = stub_device_list;
+    return 1;
+}
+
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+}
+
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+    memset(desc, 0, sizeof(*desc));
+    desc->idVendor = 0x1fc9;
+    desc->idProduct = 0x04d8;
+    desc->iSerialNumber = 1;
+    return LIBUSB_SUCCESS;
+}
+
+
+int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+    *dev_handle = (libusb_device_handle*)&stub_device;
+    return LIBUSB_SUCCESS;
+}
+
+
+void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle)
+{
+}
+
+
+int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle *dev_handle, uint8_t desc_index,
+        unsigned char *data, int length)
+{
+    snprintf((char*)data, length, "STUB");
+    return strlen((char*)data);
+}
+
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+    return LIBUSB_SUCCESS;
+}
+
+
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+    return LIBUSB_SUCCESS;
+}
+
+
+int LIBUSB_CALL libusb_set_interface_alt_setting(libusb_device_handle *dev_handle, int interface_number,
+        int alternate_setting)
+{
+    return LIBUSB_SUCCESS;
+}
+
+
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets)
+{
+    return calloc(1, sizeof(struct libusb_transfer) + iso_packets*sizeof(struct libusb_iso_packet_descriptor));
+}
+
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer)
+{
+    free(transfer);
+}
+
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+    unsigned int idx;
+
+    if (pending_count == STUB_PENDING_COUNT) {
+        return LIBUSB_ERROR_BUSY;
+    }
+
+    idx = (pending_head + pending_count++) % STUB_PENDING_COUNT;
+    pending[idx] = transfer;
+    pending_cancelled[idx] = false;
+    return LIBUSB_SUCCESS;
+}
+
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+    unsigned int i, idx;
+
+    for (i = 0; i < pending_count; i++) {
+        idx = (pending_head + i) % STUB_PENDING_COUNT;
+        if (pending[idx] == transfer) {
+            pending_cancelled[idx] = true;
+            return LIBUSB_SUCCESS;
+        }
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+
+// Completes the oldest transfer once the simulated ringbuffer has room for it, or returns at the timeout.
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed)
+{
+    double deadline = now() + tv->tv_sec + tv->tv_usec/1e6;
+    double wait;
+    struct libusb_transfer *transfer;
+    struct timespec ts;
+
+    while (1) {
+        drain_ring();
+        wait = deadline - now();
+
+        if (pending_count) {
+            transfer = pending[pending_head];
+            if (pending_cancelled[pending_head]) {
+                transfer->status = LIBUSB_TRANSFER_CANCELLED;
+                transfer->actual_length = 0;
+            } else if (ring_fill + transfer->length/STUB_SAMPLE_BYTES <= stub_ringbuffer_samples) {
+                accept_transfer(transfer);
+                transfer->status = LIBUSB_TRANSFER_COMPLETED;
+                transfer->actual_length = transfer->length;
+            } else {
+                transfer = NULL;
+                if (drain_rate()) {
+                    wait = (ring_fill + pending[pending_head]->length/STUB_SAMPLE_BYTES - stub_ringbuffer_samples)/drain_rate();
+                    wait = wait < deadline - now() ? wait : deadline - now();
+                }
+            }
+
+            if (transfer) {
+                pending_head = (pending_head + 1) % STUB_PENDING_COUNT;
+                pending_count--;
+                transfer->callback(transfer);
+                return LIBUSB_SUCCESS;
+            }
+        }
+
+        if (wait <= 0) {
+            return LIBUSB_SUCCESS;
+        }
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec)*1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+int get_fw_major_version(libusb_device_handle *devh, uint32_t *major)
+{
+    *major = LASERSHARK_FW_MAJOR_VERSION;
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+int get_fw_minor_version(libusb_device_handle *devh, uint32_t *minor)
+{
+    *minor = LASERSHARK_FW_MINOR_VERSION;
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+int clear_ringbuffer(libusb_device_handle *devh)
+{
+    ring_fill = 0;
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+int set_output(libusb_device_handle *devh, uint8_t state)
+{
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+int set_ilda_rate(libusb_device_handle *devh, uint32_t rate)
+{
+    drain_ring();
+    stub_ilda_rate = rate;
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+int get_max_ilda_rate(libusb_device_handle *devh, uint32_t *rate)
+{
+    *rate = STUB_MAX_ILDA_RATE;
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+int get_bulk_packet_sample_count(libusb_device_handle *devh, uint32_t *count)
+{
+    *count = STUB_BULK_PACKET_SAMPLES;
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+int get_dac_min(libusb_device_handle *devh, uint32_t *val)
+{
+    *val = 0;
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+int get_dac_max(libusb_device_handle *devh, uint32_t *val)
+{
+    *val = STUB_DAC_MAX;
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+int get_ringbuffer_sample_count(libusb_device_handle *devh, uint32_t *count)
+{
+    *count = stub_ringbuffer_samples;
+    return LASERSHARK_CMD_SUCCESS;
+}
+
+
+int get_ringbuffer_empty_sample_count(libusb_device_handle *devh, uint32_t *count)
+{
+    drain_ring();
+    *count = stub_ringbuffer_samples - (uint32_t)(ring_fill + 0.999);
+    return LASERSHARK_CMD_SUCCESS;
+}
@@ -0,0 +1,281 @@
+/*
+printer_stub.c - Stand-in for the 3D printer board that fullprint drives the Z-axis with, so its
+serial protocol can be tested without one attached.
+
+Runs the given command with "-p <pseudo-terminal>" added to its arguments, and answers it on the
+pseudo-terminal the way Marlin does: "start" when the port is opened, then "ok" for every line with
+the right line number and checksum, or an error and "Resend:" for any other.
+
+    ./printer_stub ./fullprint -f test.gcode > samples.txt
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Environment:
+//   PRINTER_STUB_CORRUPT  Treat every n-th line received as corrupted, once per line number, so
+//                         the command has to send it again.
+//   PRINTER_STUB_MOVE     Time in ms each M400 takes to be acknowledged, with busy messages sent
+//                         meanwhile, as if the Z-axis were still moving.
+//   PRINTER_STUB_LOG      File to write the accepted commands to, one per line.
+//
+// A summary is printed to stderr at exit. The exit status is the command's, or 1 if it sent a line
+// with a bad line number or checksum.
+
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+
+#define STUB_LINE_SIZE 256
+#define STUB_BUSY_MS 300 // Time between busy messages while an M400 is held up
+
+
+static int master = -1;
+static int last_line = -1; // Number of the last line accepted
+static int last_corrupted = -1;
+static int corrupt_every;
+static int move_ms;
+static FILE *log_file;
+
+static unsigned long lines_received;
+static unsigned long lines_accepted;
+static unsigned long lines_corrupted; // Made to look corrupted on purpose
+static unsigned long protocol_errors;
+static unsigned long moves;
+
+
+static long long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+
+static void say(const char *fmt, ...)
+{
+    char buf[STUB_LINE_SIZE];
+    va_list ap;
+    int len, off = 0, r;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    while (off < len) {
+        r = write(master, buf + off, len - off);
+        if (r < 0 && errno != EINTR && errno != EAGAIN) {
+            fprintf(stderr, "printer_stub: write failed: %s\n", strerror(errno));
+            return;
+        }
+        if (r > 0) {
+            off += r;
+        }
+    }
+}
+
+
+// Asks for the line after the last one accepted, the way Marlin does.
+static void request_resend(const char *why)
+{
+    say("Error:%s, Last Line: %d\n", why, last_line);
+    say("Resend: %d\n", last_line + 1);
+    say("ok\n");
+}
+
+
+static void handle_line(char *line)
+{
+    char *star, *cmd;
+    unsigned char checksum = 0;
+    long long end;
+    int num;
+    char *p;
+
+    lines_received++;
+
+    star = strrchr(line, '*');
+    if (line[0] != 'N' || star == NULL || (num = strtol(line + 1, &cmd, 10), *cmd != ' ')) {
+        fprintf(stderr, "printer_stub: no line number or checksum: %s\n", line);
+        protocol_errors++;
+        request_resend("No Checksum with line number");
+        return;
+    }
+    cmd++;
+
+    for (p = line; p < star; p++) {
+        checksum ^= (unsigned char)*p;
+    }
+    if (atoi(star + 1) != checksum) {
+        fprintf(stderr, "printer_stub: checksum mismatch on line %d\n", num);
+        protocol_errors++;
+        request_resend("checksum mismatch");
+        return;
+    }
+    *star = '\0';
+
+    if (corrupt_every && lines_received % corrupt_every == 0 && num != last_corrupted) {
+        last_corrupted = num;
+        lines_corrupted++;
+        request_resend("checksum mismatch");
+        return;
+    }
+
+    if (strncmp(cmd, "M110", 4) != 0 && num != last_line + 1) {
+        fprintf(stderr, "printer_stub: got line %d, expected %d\n", num, last_line + 1);
+        protocol_errors++;
+        request_resend("Line Number is not Last Line Number+1");
+        return;
+    }
+
+    last_line = num;
+    lines_accepted++;
+    if (log_file) {
+        fprintf(log_file, "%s\n", cmd);
+        fflush(log_file);
+    }
+
+    if (strncmp(cmd, "M400", 4) == 0 && move_ms > 0) {
+        moves++;
+        end = now_ms() + move_ms;
+        while (now_ms() < end) {
+            say("echo:busy: processing\n");
+            usleep((end - now_ms() < STUB_BUSY_MS ? end - now_ms() : STUB_BUSY_MS)*1000);
+        }
+    }
+    say("ok\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *corrupt = getenv("PRINTER_STUB_CORRUPT");
+    const char *move = getenv("PRINTER_STUB_MOVE");
+    const char *log_path = getenv("PRINTER_STUB_LOG");
+    char line[STUB_LINE_SIZE];
+    size_t line_len = 0;
+    char buf[4096];
+    char **args;
+    char *slave_name;
+    struct termios tty;
+    struct pollfd pfd;
+    int slave, status = 0, i, r;
+    pid_t pid;
+
+    if (argc < 2) {
+        fprintf(stderr, "%s COMMAND [ARGS] - Runs COMMAND -p <port> [ARGS] against a simulated printer board\n", argv[0]);
+        return 1;
+    }
+
+    corrupt_every = corrupt ? atoi(corrupt) : 0;
+    move_ms = move ? atoi(move) : 0;
+    if (log_path) {
+        log_file = fopen(log_path, "w");
+        if (log_file == NULL) {
+            fprintf(stderr, "printer_stub: could not open %s: %s\n", log_path, strerror(errno));
+            return 1;
+        }
+    }
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 || (slave_name = ptsname(master)) == NULL) {
+        fprintf(stderr, "printer_stub: could not open a pseudo-terminal: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // Held open so the command can open and close the port without reads here failing in between.
+    slave = open(slave_name, O_RDWR | O_NOCTTY);
+    if (slave < 0 || tcgetattr(slave, &tty) < 0) {
+        fprintf(stderr, "printer_stub: could not open %s: %s\n", slave_name, strerror(errno));
+        return 1;
+    }
+    cfmakeraw(&tty);
+    tcsetattr(slave, TCSANOW, &tty);
+
+    say("start\n");
+
+    args = malloc((argc + 3)*sizeof(char*));
+    if (args == NULL) {
+        fprintf(stderr, "printer_stub: out of memory\n");
+        return 1;
+    }
+    args[0] = argv[1];
+    args[1] = "-p";
+    args[2] = slave_name;
+    for (i = 2; i <= argc; i++) {
+        args[i + 1] = argv[i];
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "printer_stub: fork failed: %s\n", strerror(errno));
+        return 1;
+    }
+    if (pid == 0) {
+        close(master);
+        close(slave);
+        execvp(args[0], args);
+        fprintf(stderr, "printer_stub: could not run %s: %s\n", args[0], strerror(errno));
+        _exit(127);
+    }
+
+    pfd.fd = master;
+    pfd.events = POLLIN;
+    while (waitpid(pid, &status, WNOHANG) != pid) {
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        r = read(master, buf, sizeof(buf));
+        for (i = 0; i < r; i++) {
+            if (buf[i] == '\n') {
+                line[line_len] = '\0';
+                handle_line(line);
+                line_len = 0;
+            } else if (buf[i] != '\r' && line_len < sizeof(line) - 1) {
+                line[line_len++] = buf[i];
+            }
+        }
+    }
+
+    fprintf(stderr, "printer_stub: %lu lines received, %lu accepted, %lu corrupted on purpose, %lu protocol errors",
+            lines_received, lines_accepted, lines_corrupted, protocol_errors);
+    if (move_ms > 0) {
+        fprintf(stderr, ", %lu moves", moves);
+    }
+    fprintf(stderr, "\n");
+
+    if (log_file) {
+        fclose(log_file);
+    }
+    close(slave);
+    close(master);
+
+    if (protocol_errors) {
+        return 1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}